@@ -0,0 +1,478 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Microbenchmarks of the codec layer, without MQTT. See bench.h for the
+ * output format.
+ */
+
+#include <stdlib.h>
+
+#include "fhz.h"
+#include "metrics.h"
+#include "trace.h"
+#include "bench.h"
+
+#define ITERATIONS 2000000
+
+static const struct {
+	const char *command;
+	const char *payload;
+} fht_requests[] = {
+	{"desired-temp", "21.5"},
+	{"manu-temp", "off"},
+	{"day-temp", "22"},
+	{"night-temp", "17.5"},
+	{"window-open-temp", "12"},
+	{"mode", "auto"},
+	{"year", "2018"},
+	{"month", "5"},
+	{"day", "1"},
+	{"hour", "13"},
+	{"minute", "37"},
+	{"time", "2018-05-01 13:37"},
+};
+
+static struct payload corpus[2 * 256];
+static struct payload_view views[2 * 256];
+static unsigned int corpus_size;
+
+static inline struct payload_view payload_view(const struct payload *payload)
+{
+	const struct payload_view view = {
+		.tt = payload->tt,
+		.len = payload->len,
+		.data = payload->data,
+	};
+
+	return view;
+}
+
+static void fht_frame(struct payload *payload, bool ack, unsigned char upper,
+		      unsigned char lower, unsigned char cmd,
+		      unsigned char value)
+{
+	const unsigned char status[] = {0x09, 0x09, 0xa0, 0x01, upper, lower,
+					cmd, 0x00, 0x66, value};
+	const unsigned char acked[] = {0x83, 0x09, 0x83, 0x01, upper, lower,
+				       cmd, value, 0x00};
+
+	payload->tt = 0x04;
+	if (ack) {
+		payload->len = sizeof(acked);
+		memcpy(payload->data, acked, sizeof(acked));
+	} else {
+		payload->len = sizeof(status);
+		memcpy(payload->data, status, sizeof(status));
+	}
+}
+
+/*
+ * Probe the command table: every function id that decodes is part of the
+ * corpus, as status report and as ack. Values are chosen to be valid for
+ * every register.
+ */
+static void build_corpus(void)
+{
+	struct payload_view view;
+	struct fht_message message;
+	struct payload payload;
+	int id, err, i;
+
+	bench_mute();
+	for (id = 0; id < 256; id++) {
+		fht_frame(&payload, false, id % 100, 42, id, 1);
+		view = payload_view(&payload);
+		err = fht_decode(&view, &message);
+		if (err && err != -EAGAIN)
+			continue;
+
+		corpus[corpus_size++] = payload;
+		fht_frame(&corpus[corpus_size++], true, id % 100, 42, id, 1);
+	}
+	bench_unmute();
+
+	for (i = 0; i < corpus_size; i++)
+		views[i] = payload_view(&corpus[i]);
+}
+
+static void bench_fht_decode(void)
+{
+	unsigned long long start, end;
+	struct fht_message message;
+	unsigned long i;
+
+	bench_mute();
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		fht_decode(&views[i % corpus_size], &message);
+	end = now_ns();
+	bench_unmute();
+
+	report("fht_decode", ITERATIONS, end - start);
+}
+
+/* every request is encoded and sent, instead of coalescing in the queue */
+static void bench_fht_set(void)
+{
+	const struct fht_command *commands[ARRAY_SIZE(fht_requests)];
+	const struct hauscode hauscode = {96, 1};
+	static struct fhz_port port;
+	unsigned long long start, end;
+	unsigned long i;
+	unsigned int j;
+
+	port.fd = open("/dev/null", O_WRONLY);
+	if (port.fd < 0)
+		return;
+
+	fht_queue_init(&port.queue);
+	for (i = 0; i < ARRAY_SIZE(fht_requests); i++)
+		commands[i] = fht_command_lookup(fht_requests[i].command);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		fht_set(&port.queue, &hauscode,
+			commands[i % ARRAY_SIZE(commands)],
+			fht_requests[i % ARRAY_SIZE(commands)].payload);
+		/* don't wait for the queue delay */
+		for (j = 0; j < port.queue.count; j++)
+			port.queue.requests[j].due = 0;
+		fht_flush(&port);
+	}
+	end = now_ns();
+
+	close(port.fd);
+
+	report("fht_set", ITERATIONS, end - start);
+}
+
+static void bench_fht_command_lookup(void)
+{
+	unsigned long long start, end;
+	unsigned long i;
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		fht_command_lookup(fht_requests[i % ARRAY_SIZE(fht_requests)]
+				   .command);
+	end = now_ns();
+
+	report("fht_command_lookup", ITERATIONS, end - start);
+}
+
+static void bench_fhz_send(void)
+{
+	const struct payload payload = {
+		.tt = 0x04,
+		.len = 15,
+		.data = {0x02, 0x01, 0x83, 0x60, 0x01, 0x60, 0x12, 0x61, 0x05,
+			 0x62, 0x01, 0x63, 0x0d, 0x64, 0x25},
+	};
+	static struct fhz_port port;
+	unsigned long long start, end;
+	unsigned long i;
+
+	port.fd = open("/dev/null", O_WRONLY);
+	if (port.fd < 0)
+		return;
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		fhz_send(&port, &payload);
+	end = now_ns();
+
+	close(port.fd);
+
+	report("fhz_send", ITERATIONS, end - start);
+}
+
+/* serialise the corpus as it would arrive on the wire */
+static unsigned int wire_corpus(unsigned char *wire, unsigned int size,
+				bool garbage)
+{
+	unsigned int i, j, length = 0;
+	unsigned char bc;
+
+	for (i = 0; i < corpus_size; i++) {
+		if (length + corpus[i].len + 5 > size)
+			break;
+
+		if (garbage)
+			wire[length++] = 0x42;
+
+		bc = 0;
+		for (j = 0; j < corpus[i].len; j++)
+			bc += corpus[i].data[j];
+
+		wire[length++] = FHZ_MAGIC;
+		wire[length++] = corpus[i].len + 2;
+		wire[length++] = corpus[i].tt;
+		wire[length++] = bc;
+		memcpy(wire + length, corpus[i].data, corpus[i].len);
+		length += corpus[i].len;
+	}
+
+	return length;
+}
+
+static double bench_fhz_handle(const char *name, bool garbage)
+{
+	unsigned char wire[FHZ_RX_SIZE / 2];
+	unsigned long long start, end;
+	struct fhz_message message;
+	static struct fhz_port port;
+	unsigned long frames = 0;
+	unsigned int length;
+	unsigned long i;
+	int err;
+
+	length = wire_corpus(wire, sizeof(wire), garbage);
+
+	bench_mute();
+	start = now_ns();
+	for (i = 0; i < ITERATIONS / 16; i++) {
+		fhz_feed(&port, wire, length);
+		while ((err = fhz_handle(&port, &message)) != -ENODATA)
+			if (!err || err == -EAGAIN)
+				frames++;
+	}
+	end = now_ns();
+	bench_unmute();
+
+	report(name, frames, end - start);
+	return (double)(end - start) / frames;
+}
+
+/*
+ * The receive path as it was before frames were decoded in place, kept to
+ * measure what that saves: fhz_frame() copies the frame out of the ring and
+ * then its payload into struct payload, and the decoder copied the name of
+ * the command into the topic of the report. Only the decoder itself is the
+ * current one, on a view of the copy.
+ */
+char bench_topic[16];
+
+static inline unsigned int rx_level(const struct fhz_port *port)
+{
+	return port->rx.head - port->rx.tail;
+}
+
+static inline unsigned char rx_peek(const struct fhz_port *port,
+				    unsigned int offset)
+{
+	return port->rx.buffer[(port->rx.tail + offset) & (FHZ_RX_SIZE - 1)];
+}
+
+static void rx_copy(const struct fhz_port *port, unsigned char *dst,
+		    unsigned int length)
+{
+	unsigned int start = port->rx.tail & (FHZ_RX_SIZE - 1);
+	unsigned int chunk = FHZ_RX_SIZE - start;
+
+	if (chunk > length)
+		chunk = length;
+
+	memcpy(dst, port->rx.buffer + start, chunk);
+	memcpy(dst + chunk, port->rx.buffer, length - chunk);
+}
+
+static int fhz_frame(struct fhz_port *port, struct payload *payload)
+{
+	unsigned char buffer[256 + 2];
+	unsigned int length, skipped;
+	unsigned char bc; /* the dump checksum */
+	int i;
+
+	for (skipped = 0; rx_level(port); port->rx.tail++, skipped++) {
+		if (rx_peek(port, 0) != FHZ_MAGIC)
+			continue;
+
+		if (rx_level(port) < 2)
+			break;
+
+		length = rx_peek(port, 1);
+		if (length < 2)
+			continue;
+
+		if (rx_level(port) < length + 2)
+			break;
+
+		rx_copy(port, buffer, length + 2);
+
+		bc = 0;
+		for (i = 4; i < length + 2; i++)
+			bc += buffer[i];
+
+		if (bc != buffer[3]) {
+			fprintf(stderr, "Packet checksum mismatch\n");
+			metrics_inc(metrics.rx_checksum_errors);
+			continue;
+		}
+
+		if (skipped) {
+			error("Invalid packet magic, skipped %u bytes\n",
+			      skipped);
+			metrics_inc(metrics.rx_magic_errors);
+		}
+
+		metrics_inc(metrics.rx_frames[buffer[2]]);
+
+		port->rx.tail += length + 2;
+
+		payload->tt = buffer[2];
+		payload->len = length - 2;
+		memcpy(payload->data, buffer + 4, payload->len);
+
+		return 0;
+	}
+
+	if (skipped) {
+		error("Invalid packet magic, skipped %u bytes\n", skipped);
+		metrics_inc(metrics.rx_magic_errors);
+		return -EINVAL;
+	}
+
+	return -ENODATA;
+}
+
+static int fhz_handle_copying(struct fhz_port *port,
+			      struct fhz_message *message)
+{
+	struct fht_device *device;
+	struct payload_view view;
+	struct payload payload;
+	int err;
+
+	err = fhz_frame(port, &payload);
+	if (err)
+		return err;
+
+	message->stamp.available = port->rx.available;
+	message->stamp.received = monotonic_ns();
+	view = payload_view(&payload);
+	err = fht_decode(&view, &message->fht);
+	if (message->fht.report[0].topic)
+		strncpy(bench_topic, fht_report_topic(&message->fht, 0),
+			sizeof(bench_topic) - 1);
+	message->stamp.decoded = monotonic_ns();
+	trace_record(TRACE_RX_FRAME,
+		     message->stamp.received - message->stamp.available);
+	trace_record(TRACE_RX_DECODE,
+		     message->stamp.decoded - message->stamp.received);
+	if (!err || err == -EAGAIN) {
+		device = fht_device(&message->fht.hauscode);
+		if (device)
+			device->port = port->index;
+	}
+	if (!err)
+		message->machine = FHT;
+
+	return err;
+}
+
+/* the same wire as fhz_handle, through the copying receive path */
+static void bench_rx_copies(double in_place)
+{
+	unsigned char wire[FHZ_RX_SIZE / 2];
+	unsigned long long start, end;
+	struct fhz_message message;
+	static struct fhz_port port;
+	unsigned long frames = 0;
+	unsigned int length;
+	unsigned long i;
+	int err;
+
+	length = wire_corpus(wire, sizeof(wire), false);
+
+	bench_mute();
+	start = now_ns();
+	for (i = 0; i < ITERATIONS / 16; i++) {
+		fhz_feed(&port, wire, length);
+		while ((err = fhz_handle_copying(&port, &message)) != -ENODATA)
+			if (!err || err == -EAGAIN)
+				frames++;
+	}
+	end = now_ns();
+	bench_unmute();
+
+	report("fhz_handle_copying", frames, end - start);
+	printf("# rx_copies_saved: %.1f ns/frame\n",
+	       (double)(end - start) / frames - in_place);
+}
+
+/*
+ * A stray magic with a large length holds back the frame behind it, until
+ * it expires. That must not depend on further bytes. Returns the failures.
+ */
+static int check_rx_expire(void)
+{
+	unsigned char wire[2 + FHZ_FRAME_MAX];
+	struct fhz_message message;
+	static struct fhz_port port;
+	unsigned int length;
+	int timeout, err;
+
+	/* the first frame of the corpus only, far less than the length */
+	wire[0] = FHZ_MAGIC;
+	wire[1] = 0xff;
+	length = 2 + wire_corpus(wire + 2, corpus[0].len + 5, false);
+
+	bench_mute();
+	fhz_feed(&port, wire, length);
+	err = fhz_handle(&port, &message);
+	if (err != -ENODATA) {
+		bench_unmute();
+		fprintf(stderr, "check: frame behind a stray magic: %d\n", err);
+		return 1;
+	}
+
+	/* what the poll loop does without new bytes */
+	timeout = fhz_rx_timeout(&port);
+	if (timeout > 0)
+		usleep(timeout * 1000);
+	fhz_expire(&port, false);
+	while ((err = fhz_handle(&port, &message)) == -EINVAL)
+		;
+	bench_unmute();
+
+	if (timeout < 0 || timeout > FHZ_RX_TIMEOUT + 1 || err) {
+		fprintf(stderr, "check: frame not delivered after %d ms: %d\n",
+			timeout, err);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	double in_place;
+
+	fht_init();
+	build_corpus();
+
+	if (check_rx_expire())
+		return -EINVAL;
+
+	report_header();
+	printf("# corpus: %u frames\n", corpus_size);
+	bench_fht_decode();
+	bench_fht_set();
+	bench_fht_command_lookup();
+	bench_fhz_send();
+	in_place = bench_fhz_handle("fhz_handle", false);
+	bench_rx_copies(in_place);
+	bench_fhz_handle("fhz_handle_resync", true);
+
+	return 0;
+}
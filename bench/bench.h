@@ -0,0 +1,77 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Benchmarks print one tab separated line per result:
+ *   name | operations | ns/op | ops/s
+ * Lines starting with '#' are comments.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+extern unsigned long bench_published, bench_published_bytes;
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void report_header(void)
+{
+	printf("# name\toperations\tns/op\tops/s\n");
+}
+
+static inline void report(const char *name, unsigned long ops,
+			  unsigned long long ns)
+{
+	printf("%s\t%lu\t%.1f\t%.0f\n", name, ops, (double)ns / ops,
+	       ops * 1e9 / ns);
+	fflush(stdout);
+}
+
+/* silence the chatter of the code under test, e.g., ignored frames */
+static int bench_stdout = -1, bench_stderr = -1;
+
+static inline void bench_mute(void)
+{
+	int null;
+
+	fflush(stdout);
+	null = open("/dev/null", O_WRONLY);
+	if (null < 0)
+		return;
+
+	bench_stdout = dup(STDOUT_FILENO);
+	bench_stderr = dup(STDERR_FILENO);
+	dup2(null, STDOUT_FILENO);
+	dup2(null, STDERR_FILENO);
+	close(null);
+}
+
+static inline void bench_unmute(void)
+{
+	if (bench_stdout < 0)
+		return;
+
+	fflush(stdout);
+	dup2(bench_stdout, STDOUT_FILENO);
+	dup2(bench_stderr, STDERR_FILENO);
+	close(bench_stdout);
+	close(bench_stderr);
+	bench_stdout = bench_stderr = -1;
+}
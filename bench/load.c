@@ -0,0 +1,335 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Synthetic load: FHZ frames of up to 10000 virtual FHTs at a fixed rate.
+ * By default, frames go through a pipe into the regular receive, decode
+ * and publish path of this process. With -P, they are written to a pty
+ * for an external fhz2mqtt instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fhz.h"
+#include "mqtt.h"
+#include "bench.h"
+
+/* stays below PIPE_BUF, so a batch is written entirely or not at all */
+#define LOAD_BATCH 64
+#define LOAD_SAMPLES (1 << 20)
+
+enum load_kind {
+	LOAD_VALVE,
+	LOAD_TEMP_LOW,
+	LOAD_TEMP_HIGH,
+	LOAD_STATUS,
+	LOAD_ACK,
+	LOAD_KINDS,
+};
+
+static struct {
+	unsigned long generated, corrupt, truncated, dropped;
+	unsigned long accepted, rejected;
+} stats;
+
+/* write time of the latest valid frame of a hauscode */
+static unsigned long long stamps[FHT_HAUSCODE_MAX * FHT_HAUSCODE_MAX];
+static unsigned int samples[LOAD_SAMPLES];
+static unsigned long sample_count;
+
+static unsigned int error_rate;
+static unsigned int seed = 1;
+
+static unsigned int load_frame(unsigned char *frame, unsigned long seq,
+			       unsigned int hauscodes, unsigned int *hc)
+{
+	enum load_kind kind = seq % LOAD_KINDS;
+	unsigned char *data = frame + 4;
+	unsigned int length, i;
+	unsigned char bc;
+
+	*hc = (seq / LOAD_KINDS) % hauscodes;
+
+	if (kind == LOAD_ACK) {
+		const unsigned char ack[] = {0x83, 0x09, 0x83, 0x01,
+			*hc / 100, *hc % 100, 0x41, 42, 0x00};
+
+		length = sizeof(ack);
+		memcpy(data, ack, length);
+	} else {
+		static const unsigned char cmds[] = {
+			[LOAD_VALVE] = 0x00,
+			[LOAD_TEMP_LOW] = 0x42,
+			[LOAD_TEMP_HIGH] = 0x43,
+			[LOAD_STATUS] = 0x44,
+		};
+		const unsigned char status[] = {0x09, 0x09, 0xa0, 0x01,
+			*hc / 100, *hc % 100, cmds[kind], 0x00, 0x66,
+			/* temperatures between 0 and 25.5 degrees */
+			kind == LOAD_TEMP_LOW ? seq & 0xff :
+			kind == LOAD_TEMP_HIGH ? 0 : seq & 0x3f};
+
+		length = sizeof(status);
+		memcpy(data, status, length);
+	}
+
+	bc = 0;
+	for (i = 0; i < length; i++)
+		bc += data[i];
+
+	frame[0] = FHZ_MAGIC;
+	frame[1] = length + 2;
+	frame[2] = 0x04;
+	frame[3] = bc;
+	length += 4;
+
+	if (error_rate && rand_r(&seed) % 100 < error_rate) {
+		if (rand_r(&seed) & 1) {
+			frame[3] = ~bc;
+			stats.corrupt++;
+		} else {
+			length /= 2;
+			stats.truncated++;
+		}
+		*hc = -1;
+	}
+
+	return length;
+}
+
+static void load_generate(int fd, unsigned long frames, unsigned int hauscodes)
+{
+	unsigned char buffer[LOAD_BATCH * 16];
+	unsigned int hcs[LOAD_BATCH];
+	unsigned int length = 0, i;
+	unsigned long long now;
+	ssize_t ret;
+
+	for (i = 0; i < frames; i++)
+		length += load_frame(buffer + length, stats.generated + i,
+				     hauscodes, &hcs[i]);
+	stats.generated += frames;
+
+	ret = write(fd, buffer, length);
+	if (ret != length) {
+		/* a partially written frame ends up as a truncated one */
+		stats.dropped += ret > 0 ? frames - ret * frames / length :
+			frames;
+		return;
+	}
+
+	now = now_ns();
+	for (i = 0; i < frames; i++)
+		if (hcs[i] != -1)
+			stamps[hcs[i]] = now;
+}
+
+static void load_consume(struct mosquitto *mosquitto, struct fhz_port *port)
+{
+	struct fhz_message message;
+	unsigned long long now;
+	unsigned int hc;
+	int err;
+
+	if (fhz_receive(port))
+		return;
+
+	while ((err = fhz_handle(port, &message)) != -ENODATA) {
+		if (err && err != -EAGAIN) {
+			stats.rejected++;
+			continue;
+		}
+
+		stats.accepted++;
+		if (!err)
+			mqtt_publish(mosquitto, &message);
+
+		now = now_ns();
+		hc = message.fht.hauscode.upper * 100 +
+		     message.fht.hauscode.lower;
+		if (hc < ARRAY_SIZE(stamps) && stamps[hc])
+			samples[sample_count++ % LOAD_SAMPLES] =
+				now - stamps[hc];
+	}
+}
+
+static int compare(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void load_latency(void)
+{
+	static const double percentiles[] = {50, 90, 99, 99.9, 100};
+	unsigned long count, i;
+
+	count = sample_count < LOAD_SAMPLES ? sample_count : LOAD_SAMPLES;
+	if (!count)
+		return;
+
+	qsort(samples, count, sizeof(*samples), compare);
+	for (i = 0; i < ARRAY_SIZE(percentiles); i++)
+		printf("# latency p%g: %.1f us\n", percentiles[i],
+		       samples[(unsigned long)((count - 1) * percentiles[i] /
+					       100)] / 1e3);
+}
+
+static int load_open_pty(void)
+{
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd == -1 || grantpt(fd) || unlockpt(fd)) {
+		error("Unable to set up pty: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	printf("Writing frames to %s, press enter to start\n", ptsname(fd));
+	getchar();
+
+	return fd;
+}
+
+static void __attribute__((noreturn)) usage(int code)
+{
+	printf("Usage: load [-r frames/s] [-n hauscodes] [-t seconds] "
+	       "[-e percent] [-H seconds] [-P]\n"
+	       "\n"
+	       "  -r frames/s  target rate (default: 10000)\n"
+	       "  -n hauscodes number of virtual FHTs, max. 10000 "
+	       "(default: 1000)\n"
+	       "  -t seconds   duration (default: 10)\n"
+	       "  -e percent   corrupt or truncate frames (default: 0)\n"
+	       "  -H seconds   publish heartbeat (default: 0)\n"
+	       "  -P           write to a pty for an external fhz2mqtt\n");
+	exit(code);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rate = 10000, hauscodes = 1000, duration = 10;
+	unsigned long long start, now, end, due;
+	struct mqtt_options options = {
+		.heartbeat = 0,
+	};
+	struct mosquitto *mosquitto = NULL;
+	static struct fhz_port port;
+	bool external = false;
+	struct pollfd pfd;
+	unsigned long frames;
+	int fds[2], opt, timeout;
+
+	while ((opt = getopt(argc, argv, "e:hH:n:Pr:t:")) != -1) {
+		switch (opt) {
+		case 'e':
+			error_rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			options.heartbeat = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			hauscodes = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			external = true;
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			duration = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(-EINVAL);
+		}
+	}
+
+	if (!rate || !hauscodes || hauscodes > ARRAY_SIZE(stamps) ||
+	    error_rate > 100)
+		usage(-EINVAL);
+
+	if (external) {
+		fds[1] = load_open_pty();
+		if (fds[1] < 0)
+			return fds[1];
+		fds[0] = -1;
+	} else {
+		if (pipe2(fds, O_NONBLOCK)) {
+			error("pipe: %s\n", strerror(errno));
+			return -errno;
+		}
+		port.fd = fds[0];
+
+		fht_init();
+		if (mqtt_init(&mosquitto, &port, 1, "localhost", 1883, NULL, NULL,
+			      &options))
+			return -EINVAL;
+	}
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+
+	/* resync and decoding errors are expected, keep them quiet */
+	bench_mute();
+	start = now_ns();
+	end = start + duration * 1000000000ULL;
+	do {
+		now = now_ns();
+		due = (now - start) * rate / 1000000000ULL;
+		frames = due - stats.generated;
+		if (frames > LOAD_BATCH)
+			frames = LOAD_BATCH;
+		if (frames)
+			load_generate(fds[1], frames, hauscodes);
+
+		/* wait for the next frame, unless we're behind */
+		due = start + stats.generated * 1000000000ULL / rate;
+		timeout = due > now ? (due - now) / 1000000 : 0;
+		if (poll(&pfd, 1, timeout) > 0 && mosquitto)
+			load_consume(mosquitto, &port);
+	} while (now < end);
+
+	/* give the receiver a chance to catch up */
+	if (mosquitto)
+		while (poll(&pfd, 1, 0) > 0)
+			load_consume(mosquitto, &port);
+	now = now_ns();
+	bench_unmute();
+
+	printf("# target: %u frames/s from %u FHTs\n", rate, hauscodes);
+	printf("# generated %lu, corrupt %lu, truncated %lu, dropped %lu\n",
+	       stats.generated, stats.corrupt, stats.truncated, stats.dropped);
+	report_header();
+	report("load-generate", stats.generated, now - start);
+	if (mosquitto) {
+		printf("# accepted %lu, rejected %lu, published %lu\n",
+		       stats.accepted, stats.rejected, bench_published);
+		report("load-decode", stats.accepted, now - start);
+		report("load-publish", bench_published, now - start);
+		load_latency();
+		mqtt_close(mosquitto);
+		close(fds[0]);
+	}
+	close(fds[1]);
+
+	return 0;
+}
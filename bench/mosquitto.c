@@ -0,0 +1,129 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Just enough of libmosquitto to run mqtt.c without a broker. Publishing
+ * only counts messages and bytes, everything else trivially succeeds.
+ */
+
+#include <mosquitto.h>
+
+#include "bench.h"
+
+unsigned long bench_published, bench_published_bytes;
+
+static char dummy;
+static void *dummy_obj;
+static void (*dummy_on_connect)(struct mosquitto *, void *, int);
+static void (*dummy_on_publish)(struct mosquitto *, void *, int);
+
+int mosquitto_lib_init(void)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_lib_cleanup(void)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *obj)
+{
+	dummy_obj = obj;
+	return (struct mosquitto *)&dummy;
+}
+
+void mosquitto_destroy(struct mosquitto *mosq)
+{
+}
+
+int mosquitto_username_pw_set(struct mosquitto *mosq, const char *username,
+			      const char *password)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* the broker is always there and accepts the session right away */
+int mosquitto_connect_async(struct mosquitto *mosq, const char *host, int port,
+			    int keepalive)
+{
+	if (dummy_on_connect)
+		dummy_on_connect(mosq, dummy_obj, 0);
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_connect_callback_set(struct mosquitto *mosq,
+	void (*on_connect)(struct mosquitto *, void *, int))
+{
+	dummy_on_connect = on_connect;
+}
+
+void mosquitto_publish_callback_set(struct mosquitto *mosq,
+	void (*on_publish)(struct mosquitto *, void *, int))
+{
+	dummy_on_publish = on_publish;
+}
+
+int mosquitto_max_inflight_messages_set(struct mosquitto *mosq,
+					unsigned int max_inflight_messages)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub,
+			int qos)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_message_callback_set(struct mosquitto *mosq,
+	void (*on_message)(struct mosquitto *, void *,
+			   const struct mosquitto_message *))
+{
+}
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic,
+		      int payloadlen, const void *payload, int qos,
+		      bool retain)
+{
+	bench_published++;
+	bench_published_bytes += payloadlen;
+	/* written and acknowledged right away */
+	if (dummy_on_publish)
+		dummy_on_publish(mosq, dummy_obj, 0);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_read(struct mosquitto *mosq, int max_packets)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_write(struct mosquitto *mosq, int max_packets)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_misc(struct mosquitto *mosq)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_socket(struct mosquitto *mosq)
+{
+	return -1;
+}
+
+bool mosquitto_want_write(struct mosquitto *mosq)
+{
+	return false;
+}
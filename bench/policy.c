@@ -0,0 +1,208 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Publish throughput of the bridge under its QoS, retain and in-flight
+ * policies, against a real broker. Policies are given the way -Q takes
+ * them and go through mqtt_publish(). A run is over once the broker took
+ * every message: QoS 0 messages when written, QoS 1 and 2 ones when
+ * acknowledged.
+ */
+
+#include <getopt.h>
+#include <mosquitto.h>
+#include <poll.h>
+#include <stdlib.h>
+
+#include "fhz.h"
+#include "mqtt.h"
+#include "bench.h"
+
+/* valve reports of 0000 to 0099 */
+#define POLICY_HAUSCODES 100
+/* let the library write out, as the bridge does between two frames */
+#define POLICY_BATCH 64
+#define POLICY_CONNECT_TIMEOUT 5000
+
+struct policy {
+	const char *name;
+	/* in the format of -Q */
+	const char *status;
+	unsigned int inflight;
+};
+
+static const struct policy policies[] = {
+	{ "policy-qos0", "status:0:0", 20 },
+	{ "policy-qos0-retain", "status:0:1", 20 },
+	{ "policy-qos1-inflight20", "status:1:0", 20 },
+	{ "policy-qos1-inflight100", "status:1:0", 100 },
+	{ "policy-qos1-unlimited", "status:1:0", 0 },
+	{ "policy-qos2-inflight20", "status:2:0", 20 },
+};
+
+static struct fhz_port port;
+
+static void policy_message(struct fhz_message *message, unsigned long seq)
+{
+	unsigned char data[] = {0x09, 0x09, 0xa0, 0x01, 0,
+		seq % POLICY_HAUSCODES, 0x00, 0x00, 0x00, seq & 0xff};
+	const struct payload_view payload = {
+		.tt = 0xc9,
+		.len = sizeof(data),
+		.data = data,
+	};
+
+	memset(message, 0, sizeof(*message));
+	message->machine = FHT;
+	fht_decode(&payload, &message->fht);
+	message->stamp.available = message->stamp.received =
+		message->stamp.decoded = monotonic_ns();
+}
+
+/* one round of the event loop of the bridge, waiting up to timeout ms */
+static int policy_loop(struct mosquitto *mosquitto, int timeout)
+{
+	struct pollfd pollfd;
+	int due;
+
+	mqtt_poll(mosquitto, &pollfd);
+	due = mqtt_timeout(mosquitto);
+	if (due >= 0 && due < timeout)
+		timeout = due;
+	if (poll(&pollfd, 1, timeout) < 0)
+		return -errno;
+
+	return mqtt_handle(mosquitto, pollfd.revents);
+}
+
+/* don't leave the retained reports behind */
+static void policy_unretain(struct mosquitto *mosquitto)
+{
+	char topic[48];
+	unsigned int i;
+
+	for (i = 0; i < POLICY_HAUSCODES; i++) {
+		snprintf(topic, sizeof(topic), "/fhz/fht/00%02u/status/is-valve",
+			 i);
+		mosquitto_publish(mosquitto, NULL, topic, 0, NULL, 0, true);
+	}
+	while (mosquitto_want_write(mosquitto) && !policy_loop(mosquitto, 100))
+		;
+}
+
+static int policy_run(const struct policy *policy, const char *host,
+		      int port_no, unsigned long messages)
+{
+	struct mqtt_options options = {
+		/* every report goes out, however often it was seen */
+		.heartbeat = 0,
+		.inflight = policy->inflight,
+	};
+	unsigned long long start, deadline;
+	struct fhz_message message;
+	struct mosquitto *mosquitto;
+	unsigned long i;
+	int err;
+
+	err = mqtt_policy_parse(&options, policy->status);
+	if (err)
+		return err;
+
+	err = mqtt_init(&mosquitto, &port, 1, host, port_no, NULL, NULL,
+			&options);
+	if (err)
+		return err;
+
+	deadline = monotonic_ms() + POLICY_CONNECT_TIMEOUT;
+	while (!mqtt_connected()) {
+		if (monotonic_ms() >= deadline) {
+			err = -ETIMEDOUT;
+			goto close_out;
+		}
+		policy_loop(mosquitto, 100);
+	}
+
+	start = now_ns();
+	for (i = 0; i < messages; i++) {
+		policy_message(&message, i);
+		err = mqtt_publish(mosquitto, &message);
+		if (err)
+			goto close_out;
+		if (i % POLICY_BATCH == POLICY_BATCH - 1) {
+			err = policy_loop(mosquitto, 0);
+			if (err)
+				goto close_out;
+		}
+	}
+
+	while (mqtt_outstanding()) {
+		err = policy_loop(mosquitto, 100);
+		if (err)
+			goto close_out;
+	}
+	report(policy->name, messages, now_ns() - start);
+
+	if (options.policy[MQTT_CLASS_STATUS].retain)
+		policy_unretain(mosquitto);
+
+close_out:
+	if (err)
+		fprintf(stderr, "%s: %s\n", policy->name, strerror(-err));
+	mqtt_close(mosquitto);
+	return err;
+}
+
+static void __attribute__((noreturn)) usage(int code)
+{
+	printf("Usage: policy [-n messages] [host] [port]\n"
+	       "\n"
+	       "  -n messages  valve reports per policy (default: 100000)\n"
+	       "  host port    broker (default: localhost 1883)\n");
+	exit(code);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long messages = 100000;
+	const char *host = "localhost";
+	int port_no = 1883, opt, err = 0;
+	unsigned int i;
+
+	while ((opt = getopt(argc, argv, "hn:")) != -1) {
+		switch (opt) {
+		case 'n':
+			messages = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(-EINVAL);
+		}
+	}
+
+	if (optind < argc)
+		host = argv[optind++];
+	if (optind < argc)
+		port_no = strtoul(argv[optind++], NULL, 10);
+	if (!messages || optind < argc)
+		usage(-EINVAL);
+
+	fht_init();
+	port.fd = -1;
+
+	printf("# %lu valve reports to %s:%d\n", messages, host, port_no);
+	report_header();
+	for (i = 0; i < ARRAY_SIZE(policies) && !err; i++)
+		err = policy_run(&policies[i], host, port_no, messages);
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Drive the publish path with a corpus of frames. The corpus is a text
+ * file in the format of the DEBUG hexdump, one frame per line.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fhz.h"
+#include "mqtt.h"
+#include "bench.h"
+
+#define ITERATIONS 200000
+#define CORPUS_MAX 4096
+
+static struct fhz_message corpus[CORPUS_MAX];
+static struct fhz_port port;
+
+static int load_corpus(const char *path)
+{
+	struct fhz_message *message = corpus;
+	unsigned char frame[256 + 2];
+	char line[1024], *pos, *end;
+	int fds[2], err, length;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -errno;
+
+	/* feed the frames through the regular receive path */
+	if (pipe(fds)) {
+		fclose(file);
+		return -errno;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	port.fd = fds[0];
+
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#')
+			continue;
+
+		for (pos = line, length = 0; length < sizeof(frame);
+		     pos = end, length++) {
+			frame[length] = strtoul(pos, &end, 16);
+			if (end == pos)
+				break;
+		}
+
+		if (write(fds[1], frame, length) != length)
+			break;
+
+		if (fhz_receive(&port))
+			break;
+
+		while ((err = fhz_handle(&port, message)) != -ENODATA)
+			if (!err && message < corpus + CORPUS_MAX - 1)
+				message++;
+	}
+
+	fclose(file);
+	close(fds[0]);
+	close(fds[1]);
+
+	return message - corpus;
+}
+
+static void bench_publish(struct mosquitto *mosquitto, const char *name,
+			  int messages)
+{
+	unsigned long long start, end;
+	unsigned long i;
+
+	bench_published = 0;
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		mqtt_publish(mosquitto, &corpus[i % messages]);
+	end = now_ns();
+
+	report(name, ITERATIONS, end - start);
+	printf("# %s: %.2f publishes/frame\n", name,
+	       (double)bench_published / ITERATIONS);
+}
+
+/*
+ * A status report repeated right away publishes nothing, whatever the
+ * length of its topic. Returns the failures.
+ */
+static int check_suppressed(struct mosquitto *mosquitto, int messages)
+{
+	const struct fht_message *message;
+	int i, failures = 0;
+
+	for (i = 0; i < messages; i++) {
+		message = &corpus[i].fht;
+		if (message->type != STATUS)
+			continue;
+
+		mqtt_publish(mosquitto, &corpus[i]);
+		bench_published = 0;
+		mqtt_publish(mosquitto, &corpus[i]);
+		if (bench_published) {
+			fprintf(stderr, "check: %s of %02u%02u not suppressed\n",
+				fht_report_topic(message, 0),
+				message->hauscode.upper,
+				message->hauscode.lower);
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+/*
+ * Suppression holds for every device, not just as many as a cache has
+ * room for: is-valve and desired-temp of all hauscodes, published twice.
+ * Returns the failures.
+ */
+static int check_suppressed_all(struct mosquitto *mosquitto)
+{
+	static const unsigned char cmds[] = {0x00, 0x41};
+	unsigned char data[] = {0x09, 0x09, 0xa0, 0x01, 0, 0, 0, 0x00, 0x69,
+				42};
+	const struct payload_view view = {
+		.tt = 0x04,
+		.len = sizeof(data),
+		.data = data,
+	};
+	struct fhz_message message = {
+		.machine = FHT,
+	};
+	const unsigned int reports = FHT_HAUSCODE_MAX * FHT_HAUSCODE_MAX *
+				     sizeof(cmds);
+	unsigned long published = 0;
+	unsigned int round, i;
+
+	for (round = 0; round < 2; round++) {
+		bench_published = 0;
+		for (i = 0; i < reports; i++) {
+			data[4] = i / sizeof(cmds) / FHT_HAUSCODE_MAX;
+			data[5] = i / sizeof(cmds) % FHT_HAUSCODE_MAX;
+			data[6] = cmds[i % sizeof(cmds)];
+			if (!fht_decode(&view, &message.fht))
+				mqtt_publish(mosquitto, &message);
+		}
+		published = bench_published;
+	}
+
+	if (published) {
+		fprintf(stderr, "check: %lu of %u reports not suppressed\n",
+			published, reports);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct mqtt_options options = {
+		.heartbeat = 0,
+	};
+	struct mosquitto *mosquitto;
+	int messages;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s corpus\n", argv[0]);
+		return -EINVAL;
+	}
+
+	fht_init();
+
+	messages = load_corpus(argv[1]);
+	if (messages <= 0) {
+		fprintf(stderr, "Unable to load corpus %s\n", argv[1]);
+		return -EINVAL;
+	}
+
+	if (mqtt_init(&mosquitto, &port, 1, "localhost", 1883, NULL, NULL,
+		      &options))
+		return -EINVAL;
+	report_header();
+	bench_publish(mosquitto, "publish", messages);
+
+	/* every value was published once, now they are all suppressed */
+	options.heartbeat = 3600;
+	if (mqtt_init(&mosquitto, &port, 1, "localhost", 1883, NULL, NULL,
+		      &options))
+		return -EINVAL;
+	bench_publish(mosquitto, "publish-cached", messages);
+	if (check_suppressed(mosquitto, messages) ||
+	    check_suppressed_all(mosquitto))
+		return -EINVAL;
+
+	/* binary reports on top of the suppressed text ones */
+	options.binary = true;
+	if (mqtt_init(&mosquitto, &port, 1, "localhost", 1883, NULL, NULL,
+		      &options))
+		return -EINVAL;
+	bench_publish(mosquitto, "publish-binary", messages);
+
+	mqtt_close(mosquitto);
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "fhz.h"
+
+#define RECORD_HEADER 11
+
+static FILE *capture;
+
+int capture_open(const char *path)
+{
+	capture = fopen(path, "wb");
+	if (!capture) {
+		error("opening %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	if (fwrite(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1, 1, capture) != 1) {
+		error("writing %s: %s\n", path, strerror(errno));
+		capture_close();
+		return -EIO;
+	}
+
+	return 0;
+}
+
+void capture_close(void)
+{
+	if (capture)
+		fclose(capture);
+	capture = NULL;
+}
+
+void capture_data(enum capture_direction direction,
+		  const unsigned char *data, unsigned int length)
+{
+	unsigned char header[RECORD_HEADER];
+	unsigned long long stamp;
+	int i;
+
+	if (!capture || !length)
+		return;
+
+	stamp = monotonic_ns();
+	for (i = 0; i < 8; i++)
+		header[i] = stamp >> (8 * i);
+	header[8] = direction;
+	header[9] = length;
+	header[10] = length >> 8;
+
+	/* flush every chunk, a capture is most useful after a crash */
+	if (fwrite(header, sizeof(header), 1, capture) != 1 ||
+	    fwrite(data, length, 1, capture) != 1 ||
+	    fflush(capture)) {
+		error("Capture failed, stopped: %s\n", strerror(errno));
+		capture_close();
+	}
+}
+
+static int replay_next(struct replay *replay)
+{
+	unsigned char header[RECORD_HEADER];
+	int i;
+
+	replay->pending = false;
+
+	if (fread(header, sizeof(header), 1, replay->file) != 1)
+		return feof(replay->file) ? -ENODATA : -EIO;
+
+	replay->stamp = 0;
+	for (i = 0; i < 8; i++)
+		replay->stamp |= (unsigned long long)header[i] << (8 * i);
+	replay->direction = header[8];
+	replay->length = header[9] | header[10] << 8;
+
+	if (!replay->length || replay->length > sizeof(replay->data) ||
+	    fread(replay->data, replay->length, 1, replay->file) != 1) {
+		fprintf(stderr, "Truncated capture\n");
+		return -EIO;
+	}
+
+	replay->pending = true;
+	return 0;
+}
+
+int replay_open(struct replay *replay, const char *path, bool realtime)
+{
+	char magic[sizeof(CAPTURE_MAGIC) - 1];
+	int err;
+
+	memset(replay, 0, sizeof(*replay));
+	replay->realtime = realtime;
+
+	replay->file = fopen(path, "rb");
+	if (!replay->file) {
+		error("opening %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	if (fread(magic, sizeof(magic), 1, replay->file) != 1 ||
+	    memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+		error("%s is no capture\n", path);
+		err = -EINVAL;
+		goto close_out;
+	}
+
+	err = replay_next(replay);
+	if (err)
+		goto close_out;
+
+	replay->start = monotonic_ns();
+	replay->offset = replay->start - replay->stamp;
+
+	return 0;
+
+close_out:
+	fclose(replay->file);
+	return err;
+}
+
+int replay_timeout(struct replay *replay)
+{
+	unsigned long long now, due;
+
+	if (!replay->pending)
+		return -1;
+
+	if (!replay->realtime)
+		return 0;
+
+	now = monotonic_ns();
+	due = replay->stamp + replay->offset;
+	if (due <= now)
+		return 0;
+
+	return (due - now + 999999) / 1000000;
+}
+
+/*
+ * Feed all received chunks that are due into the port, as if read() had
+ * returned them. As fast as possible means as much as fits into the
+ * receive buffer. Returns -ENODATA once the capture is exhausted.
+ */
+int replay_feed(struct replay *replay, struct fhz_port *port)
+{
+	bool fed = false;
+	int err;
+
+	while (replay->pending && !replay_timeout(replay)) {
+		/* our own transmissions are not replayed */
+		if (replay->direction == CAPTURE_RX) {
+			/*
+			 * As fast as possible, a torn frame expires by the
+			 * silence in the capture. What was fed before is
+			 * handled first, and so are the frames behind it.
+			 */
+			if (!replay->realtime && replay->last &&
+			    replay->stamp - replay->last >
+			    FHZ_RX_TIMEOUT * 1000000ULL &&
+			    fhz_rx_timeout(port) >= 0) {
+				if (!fed)
+					fhz_expire(port, true);
+				return 0;
+			}
+
+			err = fhz_feed(port, replay->data, replay->length);
+			if (err == -ENOBUFS)
+				return 0;
+			if (err)
+				return err;
+			replay->last = replay->stamp;
+			fed = true;
+			replay->chunks++;
+			replay->bytes += replay->length;
+		}
+
+		err = replay_next(replay);
+		if (err && err != -ENODATA)
+			return err;
+	}
+
+	return replay->pending ? 0 : -ENODATA;
+}
+
+void replay_close(struct replay *replay)
+{
+	double elapsed = (monotonic_ns() - replay->start) / 1e9;
+
+	printf("Replayed %lu bytes in %lu reads in %.3fs, %.0f bytes/s\n",
+	       replay->bytes, replay->chunks, elapsed, replay->bytes / elapsed);
+
+	fclose(replay->file);
+}
@@ -0,0 +1,59 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * A capture starts with CAPTURE_MAGIC, followed by one record per chunk:
+ *   u64 timestamp | u8 direction | u16 length | data
+ * The timestamp is CLOCK_MONOTONIC in ns, integers are little endian.
+ * Received chunks are the bytes of one read() as they came from the FHZ,
+ * garbage and torn frames included, so that replays resync the same way.
+ * Sent chunks are one frame each.
+ */
+#define CAPTURE_MAGIC "FHZCAP2\n"
+/* max. size of a chunk, one read() never exceeds the receive buffer */
+#define CAPTURE_CHUNK_MAX 1024
+
+enum capture_direction {
+	CAPTURE_RX = 0,
+	CAPTURE_TX = 1,
+};
+
+struct replay {
+	FILE *file;
+	bool realtime;
+	bool pending;
+	/* offset between the timestamps of the capture and now, in ns */
+	unsigned long long offset;
+	unsigned long long stamp;
+	/* of the last received chunk that was fed */
+	unsigned long long last;
+	unsigned char direction;
+	unsigned int length;
+	unsigned char data[CAPTURE_CHUNK_MAX];
+	unsigned long chunks, bytes;
+	unsigned long long start;
+};
+
+struct fhz_port;
+
+int capture_open(const char *path);
+void capture_close(void);
+void capture_data(enum capture_direction direction,
+		  const unsigned char *data, unsigned int length);
+
+int replay_open(struct replay *replay, const char *path, bool realtime);
+void replay_close(struct replay *replay);
+int replay_timeout(struct replay *replay);
+int replay_feed(struct replay *replay, struct fhz_port *port);
@@ -12,6 +12,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -20,9 +21,14 @@
 #include <unistd.h>
 
 #include "fhz.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define FHT_YEAR_BASE 2000
 
+/* max. age of the first half of a multi-frame value, in ms */
+#define FHT_PENDING_TIMEOUT 10000
+
 #define FHT_TEMP_OFF 5.5
 #define FHT_TEMP_ON 30.5
 
@@ -57,28 +63,71 @@
 #define FHT_NIGHT_TEMP 0x84
 #define FHT_WINDOW_OPEN_TEMP 0x8a
 
-#define __report_printf(__message, __no, __field, ...) \
-	snprintf(__message->report[__no].__field, \
-		 sizeof(__message->report[__no].__field), \
-		 __VA_ARGS__)
+#define report_printf_value(__message, __no, ...) \
+	report_set_length(__message, __no, \
+			  snprintf(__message->report[__no].value, \
+				   sizeof(__message->report[__no].value), \
+				   __VA_ARGS__))
+
+#define report_topic(__message, __no, __topic) \
+	((__message)->report[__no].topic = (__topic))
+
+#define VALVE_TOPICS(__slot, __suffix) \
+	[__slot + 0] = "valve/0" __suffix, [__slot + 1] = "valve/1" __suffix, \
+	[__slot + 2] = "valve/2" __suffix, [__slot + 3] = "valve/3" __suffix, \
+	[__slot + 4] = "valve/4" __suffix, [__slot + 5] = "valve/5" __suffix, \
+	[__slot + 6] = "valve/6" __suffix, [__slot + 7] = "valve/7" __suffix, \
+	[__slot + 8] = "valve/8" __suffix
+
+/* the command that reports a field, filled by fht_init() */
+static const struct fht_command *fht_field_commands[FHT_FIELDS];
+
+/* indexed by enum fht_slot, the names of commands are added by fht_init() */
+static const char *fht_slot_topics[FHT_SLOTS] = {
+	[FHT_SLOT_WINDOW] = "window",
+	[FHT_SLOT_BATTERY] = "battery",
+	[FHT_SLOT_SYNCTIME] = "synctime",
+	VALVE_TOPICS(FHT_SLOT_VALVE, ""),
+	VALVE_TOPICS(FHT_SLOT_VALVE_OFFSET, "/offset"),
+};
 
-#define report_printf_topic(__message, __no, ...) \
-	__report_printf(__message, __no, topic, __VA_ARGS__)
+/* remember the length, so nobody has to strlen() the value again */
+static inline void report_set_length(struct fht_message *message, int no,
+				     int length)
+{
+	if (length >= sizeof(message->report[no].value))
+		length = sizeof(message->report[no].value) - 1;
+	message->report[no].length = length;
+}
 
-#define report_printf_value(__message, __no, ...) \
-	__report_printf(__message, __no, value, __VA_ARGS__)
+/* the value of a report in fixed point: fixed * 10^exponent */
+static inline void report_fixed(struct fht_message *message, int fixed,
+				signed char exponent)
+{
+	message->raw.scaled = true;
+	message->raw.fixed = fixed;
+	message->raw.exponent = exponent;
+}
 
 struct fht_message_raw {
 	unsigned char cmd;
 	unsigned char subfun;
 	unsigned char status;
 	unsigned char value;
+	struct fht_device *device;
+	enum fht_field field;
 };
 
 struct fht_command {
-	unsigned char function_id;
 	const char *name;
+	enum fht_field field;
 	int (*input_conversion)(const char *payload);
+	/*
+	 * for requests that span several registers, called with the queue
+	 * locked
+	 */
+	int (*enqueue)(struct fht_queue *queue, const struct hauscode *hauscode,
+		       const char *payload);
 	int (*output_conversion)(struct fht_message *message,
 				 const struct fht_message_raw *raw);
 };
@@ -88,11 +137,65 @@ struct fht_command {
 	    (counter) < ARRAY_SIZE((commands)); \
 	    (counter)++, (command)++)
 
+/* the table is indexed by the function id */
+#define fht_command_id(command) ((command) - fht_commands)
+
 static const char s_mode_auto[] = "auto";
 static const char s_mode_holiday[] = "holiday";
 static const char s_mode_manual[] = "manual";
 
-static unsigned char temp_low;
+static struct fht_device fht_devices[FHT_HAUSCODE_MAX][FHT_HAUSCODE_MAX];
+
+struct fht_device *fht_device(const struct hauscode *hauscode)
+{
+	if (!hauscode_valid(hauscode))
+		return NULL;
+
+	return &fht_devices[hauscode->upper][hauscode->lower];
+}
+
+/*
+ * A consistent copy of a device, however the thread that decodes updates it
+ * in the meanwhile.
+ */
+int fht_device_read(const struct hauscode *hauscode, struct fht_device *copy)
+{
+	const struct fht_device *device = fht_device(hauscode);
+	unsigned int seq;
+
+	if (!device)
+		return -EINVAL;
+
+	do {
+		seq = atomic_load_explicit(&device->seq, memory_order_acquire);
+		memcpy(copy, device, sizeof(*copy));
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) ||
+		 seq != atomic_load_explicit(&device->seq,
+					     memory_order_relaxed));
+
+	return 0;
+}
+
+static inline void fht_device_set(struct fht_device *device,
+				  enum fht_field field, unsigned char value)
+{
+	device->value[field] = value;
+	device->valid |= 1 << field;
+	device->stale &= ~(1 << field);
+}
+
+/* remember the decoded value of the register behind raw */
+static inline void fht_store(struct fht_message *message,
+			     const struct fht_message_raw *raw,
+			     unsigned char value)
+{
+	if (!raw->field)
+		return;
+
+	fht_device_set(raw->device, raw->field, value);
+	message->state = true;
+}
 
 static int payload_to_fht_temp(const char *payload)
 {
@@ -118,6 +221,8 @@ static int fht_temp_to_str(struct fht_message *message,
 			   const struct fht_message_raw *raw)
 {
 	report_printf_value(message, 0, "%0.1f", (float)raw->value * 0.5);
+	report_fixed(message, raw->value * 5, -1);
+	fht_store(message, raw, raw->value);
 	return 0;
 }
 
@@ -133,29 +238,37 @@ static int payload_to_mode(const char *payload)
 	return -EINVAL;
 }
 
+static const char *fht_mode_name(unsigned char mode)
+{
+	switch (mode) {
+	case FHT_MODE_AUTO:
+		return s_mode_auto;
+	case FHT_MODE_MANU:
+		return s_mode_manual;
+	case FHT_MODE_HOLI:
+		return s_mode_holiday;
+	default:
+		return NULL;
+	}
+}
+
 static int mode_to_str(struct fht_message *message,
 		       const struct fht_message_raw *raw)
 {
 	const char *src;
 	int err = 0;
 
-	switch (raw->value) {
-	case FHT_MODE_AUTO:
-		src = s_mode_auto;
-		break;
-	case FHT_MODE_MANU:
-		src = s_mode_manual;
-		break;
-	case FHT_MODE_HOLI:
-		src = s_mode_holiday;
-		break;
-	default:
+	src = fht_mode_name(raw->value);
+	if (!src) {
 		src = "unknown";
 		err = -EINVAL;
-		break;
 	}
 
 	report_printf_value(message, 0, src);
+	if (!err) {
+		report_fixed(message, raw->value, 0);
+		fht_store(message, raw, raw->value);
+	}
 
 	return err;
 }
@@ -168,15 +281,30 @@ static int input_not_accepted(const char *payload)
 static int fht_is_temp_low(struct fht_message *message,
 			   const struct fht_message_raw *raw)
 {
-	temp_low = raw->value;
+	raw->device->pending.stamp = monotonic_ms();
+	raw->device->pending.value = raw->value;
 	return -EAGAIN;
 }
 
 static int fht_is_temp_high_to_str(struct fht_message *message,
 				   const struct fht_message_raw *raw)
 {
+	struct fht_device *device = raw->device;
+	unsigned char temp_low;
+
+	/* the low byte got lost or belongs to an earlier report */
+	if (!device->pending.stamp ||
+	    monotonic_ms() - device->pending.stamp > FHT_PENDING_TIMEOUT)
+		return -EAGAIN;
+
+	temp_low = device->pending.value;
+	device->pending.stamp = 0;
+
 	report_printf_value(message, 0, "%0.2f",
 			    ((float)temp_low + (float)raw->value* 256)/10.0);
+	report_fixed(message, temp_low + raw->value * 256, -1);
+	fht_device_set(device, FHT_FIELD_IS_TEMP_LOW, temp_low);
+	fht_store(message, raw, raw->value);
 	return 0;
 }
 
@@ -194,6 +322,8 @@ static int fht_year_to_str(struct fht_message *message,
 			   const struct fht_message_raw *raw)
 {
 	report_printf_value(message, 0, "%u", FHT_YEAR_BASE + raw->value);
+	report_fixed(message, FHT_YEAR_BASE + raw->value, 0);
+	fht_store(message, raw, raw->value);
 	return 0;
 }
 
@@ -217,6 +347,8 @@ static int fht_month_to_str(struct fht_message *message,
 		return -EINVAL;
 
 	report_printf_value(message, 0, "%u", raw->value);
+	report_fixed(message, raw->value, 0);
+	fht_store(message, raw, raw->value);
 	return 0;
 }
 
@@ -240,6 +372,8 @@ static int fht_day_to_str(struct fht_message *message,
 		return -EINVAL;
 
 	report_printf_value(message, 0, "%u", raw->value);
+	report_fixed(message, raw->value, 0);
+	fht_store(message, raw, raw->value);
 	return 0;
 }
 
@@ -263,6 +397,8 @@ static int fht_hour_to_str(struct fht_message *message,
 		return -EINVAL;
 
 	report_printf_value(message, 0, "%u", raw->value);
+	report_fixed(message, raw->value, 0);
+	fht_store(message, raw, raw->value);
 	return 0;
 }
 
@@ -286,6 +422,8 @@ static int fht_minute_to_str(struct fht_message *message,
 		return -EINVAL;
 
 	report_printf_value(message, 0, "%u", raw->value);
+	report_fixed(message, raw->value, 0);
+	fht_store(message, raw, raw->value);
 	return 0;
 }
 
@@ -315,10 +453,12 @@ static int fht_percentage_to_str(struct fht_message *message,
 	case 0x6:
 		break;
 	case 0x8: /* value contains OFFSET setting */
-		report_printf_topic(message, 0, "valve/%u/offset", raw->cmd);
+		report_topic(message, 0, FHT_TOPIC_VALVE_OFFSET);
 		report_printf_value(message, 0, "%s%u",
 				    raw->value & 0x80 ? "-" : "",
 				    raw->value & 0x7f);
+		report_fixed(message, raw->value & 0x80 ?
+			     -(raw->value & 0x7f) : raw->value & 0x7f, 0);
 		return 0;
 		break;
 	case 0xa: /* lime-protection */
@@ -330,33 +470,39 @@ static int fht_percentage_to_str(struct fht_message *message,
 		/* TBD: submit lime-protection */
 		break;
 	case 0xc: /* synctime */
-		report_printf_topic(message, 0, "synctime");
+		report_topic(message, 0, FHT_TOPIC_SYNCTIME);
 		report_printf_value(message, 0, "%u", (raw->value / 2) - 1);
+		report_fixed(message, (raw->value / 2) - 1, 0);
 		return 0;
 		break;
 	case 0xe: /* TEST */
 		return -EINVAL;
 		break;
 	case 0xf: /* pair */
-		report_printf_topic(message, 1, "valve/%u", raw->cmd);
+		report_topic(message, 1, FHT_TOPIC_VALVE);
 		report_printf_value(message, 1, "paired");
 		break;
 	}
 
 	report_printf_value(message, 0, "%0.1f", (float)valve * 100 / 255);
+	report_fixed(message, (valve * 1000 + 127) / 255, -1);
+	fht_store(message, raw, valve);
 	return 0;
 }
 
 static int fht_status_to_str(struct fht_message *message,
 			     const struct fht_message_raw *raw)
 {
-	report_printf_topic(message, 0, "window");
+	report_topic(message, 0, FHT_TOPIC_WINDOW);
 	report_printf_value(message, 0, "%s",
 			    raw->value & (1 << 5) ? "open" : "close");
 
-	report_printf_topic(message, 1, "battery");
+	report_topic(message, 1, FHT_TOPIC_BATTERY);
 	report_printf_value(message, 1, "%s",
 			    raw->value & (1 << 0) ? "empty" : "ok");
+	/* the raw bits, window and battery are left to the consumer */
+	report_fixed(message, raw->value, 0);
+	fht_store(message, raw, raw->value);
 	return 0;
 }
 
@@ -369,24 +515,27 @@ static int fht_ignore(struct fht_message *message,
 }
 
 #define DEFINE_VALVE(__no) \
-	{ \
-		.function_id = FHT_VALVE_##__no, \
+	[FHT_VALVE_##__no] = { \
 		.name = "valve/" __stringify(__no), \
+		.field = FHT_FIELD_VALVE_##__no, \
 		.input_conversion = input_not_accepted, \
 		.output_conversion = fht_percentage_to_str, \
 	}
 
 #define DEFINE_IGNORE(__no) \
-	{ \
-		.function_id = __no, \
+	[__no] = { \
 		.input_conversion = input_not_accepted, \
 		.output_conversion = fht_ignore, \
 	}
 
-static const struct fht_command fht_commands[] = {
-	/* is valve */ {
-		.function_id = FHT_IS_VALVE,
+/*
+ * Dispatch table for received frames. Slots without an output_conversion
+ * are unknown function ids.
+ */
+static const struct fht_command fht_commands[256] = {
+	[FHT_IS_VALVE] = {
 		.name = "is-valve",
+		.field = FHT_FIELD_IS_VALVE,
 		.input_conversion = input_not_accepted,
 		.output_conversion = fht_percentage_to_str,
 	},
@@ -398,103 +547,105 @@ static const struct fht_command fht_commands[] = {
 	DEFINE_VALVE(6),
 	DEFINE_VALVE(7),
 	DEFINE_VALVE(8),
-	/* mode */ {
-		.function_id = FHT_MODE,
+	[FHT_MODE] = {
 		.name = "mode",
+		.field = FHT_FIELD_MODE,
 		.input_conversion = payload_to_mode,
 		.output_conversion = mode_to_str,
 	},
-	/* desired temp */ {
-		.function_id = FHT_DESIRED_TEMP,
+	[FHT_DESIRED_TEMP] = {
 		.name = "desired-temp",
+		.field = FHT_FIELD_DESIRED_TEMP,
 		.input_conversion = payload_to_fht_temp,
 		.output_conversion = fht_temp_to_str,
 	},
-	/* is temp low */ {
-		.function_id = FHT_IS_TEMP_LOW,
+	[FHT_IS_TEMP_LOW] = {
 		.input_conversion = input_not_accepted,
 		.output_conversion = fht_is_temp_low,
 	},
-	/* is temp high */ {
-		.function_id = FHT_IS_TEMP_HIGH,
+	[FHT_IS_TEMP_HIGH] = {
 		.name = "is-temp",
+		.field = FHT_FIELD_IS_TEMP_HIGH,
 		.input_conversion = input_not_accepted,
 		.output_conversion = fht_is_temp_high_to_str,
 	},
-	/* status */ {
-		.function_id = FHT_STATUS,
+	[FHT_STATUS] = {
 		.name = "status",
+		.field = FHT_FIELD_STATUS,
 		.input_conversion = input_not_accepted,
 		.output_conversion = fht_status_to_str,
 	},
-	/* manu temp */ {
-		.function_id = FHT_MANU_TEMP,
+	[FHT_MANU_TEMP] = {
 		.name = "manu-temp",
+		.field = FHT_FIELD_MANU_TEMP,
 		.input_conversion = payload_to_fht_temp,
 		.output_conversion = fht_temp_to_str,
 	},
 	/* ack, ack2, {start,end}-xmit, we don't forward this */
 	DEFINE_IGNORE(FHT_ACK),
-	/* year */ {
-		.function_id = FHT_YEAR,
+	[FHT_YEAR] = {
 		.name = "year",
+		.field = FHT_FIELD_YEAR,
 		.input_conversion = payload_to_fht_year,
 		.output_conversion = fht_year_to_str,
 	},
-	/* month */ {
-		.function_id = FHT_MONTH,
+	[FHT_MONTH] = {
 		.name = "month",
+		.field = FHT_FIELD_MONTH,
 		.input_conversion = payload_to_fht_month,
 		.output_conversion = fht_month_to_str,
 	},
-	/* day */ {
-		.function_id = FHT_DAY,
+	[FHT_DAY] = {
 		.name = "day",
+		.field = FHT_FIELD_DAY,
 		.input_conversion = payload_to_fht_day,
 		.output_conversion = fht_day_to_str,
 	},
-	/* hour */ {
-		.function_id = FHT_HOUR,
+	[FHT_HOUR] = {
 		.name = "hour",
+		.field = FHT_FIELD_HOUR,
 		.input_conversion = payload_to_fht_hour,
 		.output_conversion = fht_hour_to_str,
 	},
-	/* minute */ {
-		.function_id = FHT_MINUTE,
+	[FHT_MINUTE] = {
 		.name = "minute",
+		.field = FHT_FIELD_MINUTE,
 		.input_conversion = payload_to_fht_minute,
 		.output_conversion = fht_minute_to_str,
 	},
 	DEFINE_IGNORE(FHT_ACK2),
 	DEFINE_IGNORE(FHT_START_XMIT),
 	DEFINE_IGNORE(FHT_END_XMIT),
-	/* day temp */ {
-		.function_id = FHT_DAY_TEMP,
+	[FHT_DAY_TEMP] = {
 		.name = "day-temp",
+		.field = FHT_FIELD_DAY_TEMP,
 		.input_conversion = payload_to_fht_temp,
 		.output_conversion = fht_temp_to_str,
 	},
-	/* night temp */ {
-		.function_id = FHT_NIGHT_TEMP,
+	[FHT_NIGHT_TEMP] = {
 		.name = "night-temp",
+		.field = FHT_FIELD_NIGHT_TEMP,
 		.input_conversion = payload_to_fht_temp,
 		.output_conversion = fht_temp_to_str,
 	},
-	/* window open temp */ {
-		.function_id = FHT_WINDOW_OPEN_TEMP,
+	[FHT_WINDOW_OPEN_TEMP] = {
 		.name = "window-open-temp",
+		.field = FHT_FIELD_WINDOW_OPEN_TEMP,
 		.input_conversion = payload_to_fht_temp,
 		.output_conversion = fht_temp_to_str,
 	},
 };
 
-int fht_decode(const struct payload *payload, struct fht_message *message)
+/* works on the frame in place, the payload must stay valid meanwhile */
+int fht_decode(const struct payload_view *payload,
+	       struct fht_message *message)
 {
 	static const unsigned char magic_ack[] = {0x83, 0x09, 0x83, 0x01};
 	static const unsigned char magic_status[] = {0x09, 0x09, 0xa0, 0x01};
 	struct fht_message_raw fht_message_raw = {0, 0, 0, 0};
 	const struct fht_command *fht_command;
-	int i;
+	struct timespec ts;
+	int err;
 
 	memset(message, 0, sizeof(*message));
 
@@ -517,54 +668,553 @@ int fht_decode(const struct payload *payload, struct fht_message *message)
 
 	message->hauscode = *(const struct hauscode*)(payload->data + 4);
 
-	for_each_fht_command(fht_commands, fht_command, i) {
-		if (fht_command->function_id != fht_message_raw.cmd)
+	fht_message_raw.device = fht_device(&message->hauscode);
+	fht_command = &fht_commands[fht_message_raw.cmd];
+	if (!fht_message_raw.device || !fht_command->output_conversion) {
+		err = -EINVAL;
+		goto out;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fht_device_write_begin(fht_message_raw.device);
+	fht_message_raw.device->last_seen = ts.tv_sec;
+	message->raw.time = (unsigned long long)ts.tv_sec * 1000 +
+			    ts.tv_nsec / 1000000;
+	message->raw.cmd = fht_message_raw.cmd;
+	message->raw.status = fht_message_raw.status;
+	message->raw.value = fht_message_raw.value;
+
+	if (fht_command->name)
+		report_topic(message, 0, FHT_TOPIC_COMMAND);
+	fht_message_raw.field = fht_command->field;
+	err = fht_command->output_conversion(message, &fht_message_raw);
+	fht_device_write_end(fht_message_raw.device);
+
+out:
+	metrics_inc(metrics.decode[fht_message_raw.cmd]
+				  [metrics_decode_result(err)]);
+	return err;
+}
+
+int fht_report_slot(const struct fht_message *message, int no)
+{
+	unsigned char cmd = message->raw.cmd;
+
+	switch (message->report[no].topic) {
+	case FHT_TOPIC_COMMAND:
+		return fht_commands[cmd].name && fht_commands[cmd].field ?
+		       fht_commands[cmd].field : -EINVAL;
+	case FHT_TOPIC_WINDOW:
+		return FHT_SLOT_WINDOW;
+	case FHT_TOPIC_BATTERY:
+		return FHT_SLOT_BATTERY;
+	case FHT_TOPIC_SYNCTIME:
+		return FHT_SLOT_SYNCTIME;
+	case FHT_TOPIC_VALVE:
+		return cmd < FHT_VALVES ? FHT_SLOT_VALVE + cmd : -EINVAL;
+	case FHT_TOPIC_VALVE_OFFSET:
+		return cmd < FHT_VALVES ? FHT_SLOT_VALVE_OFFSET + cmd : -EINVAL;
+	default:
+		return -EINVAL;
+	}
+}
+
+/* NULL for slots that no report uses */
+const char *fht_slot_topic(unsigned int slot)
+{
+	return slot < FHT_SLOTS ? fht_slot_topics[slot] : NULL;
+}
+
+const char *fht_report_topic(const struct fht_message *message, int no)
+{
+	int slot = fht_report_slot(message, no);
+
+	return slot < 0 ? NULL : fht_slot_topics[slot];
+}
+
+static int __attribute__((format(printf, 4, 5)))
+json_append(char *buffer, size_t size, size_t *length, const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	ret = vsnprintf(buffer + *length, size - *length, format, ap);
+	va_end(ap);
+
+	if (ret < 0 || ret >= size - *length)
+		return -ENOSPC;
+
+	*length += ret;
+	return 0;
+}
+
+/*
+ * Render everything we know about a FHT as one JSON object, with the same
+ * names and units as the individual reports. Returns the length.
+ */
+int fht_state_json(const struct hauscode *hauscode, char *buffer, size_t size)
+{
+	const struct fht_command *command;
+	const unsigned char *value;
+	struct fht_device device;
+	enum fht_field field;
+	unsigned int valid;
+	size_t length = 0;
+	const char *sep;
+	int i, err;
+
+	/* the serial side may update the device in the meanwhile */
+	err = fht_device_read(hauscode, &device);
+	if (err)
+		return err;
+	valid = device.valid;
+	value = device.value;
+
+	err = json_append(buffer, size, &length, "{");
+	if (!err && device.stale)
+		err = json_append(buffer, size, &length, "\"stale\":true");
+	for_each_fht_command(fht_commands, command, i) {
+		field = command->field;
+		if (err || !field || !(valid & (1 << field)))
 			continue;
-		if (fht_command->name)
-			strncpy(message->report[0].topic, fht_command->name,
-				sizeof(message->report[0].topic));
-		return fht_command->output_conversion(message,
-						      &fht_message_raw);
+
+		sep = length > 1 ? "," : "";
+		switch (field) {
+		case FHT_FIELD_MODE:
+			err = json_append(buffer, size, &length,
+					  "%s\"%s\":\"%s\"", sep, command->name,
+					  fht_mode_name(value[field]));
+			break;
+		case FHT_FIELD_DESIRED_TEMP:
+		case FHT_FIELD_MANU_TEMP:
+		case FHT_FIELD_DAY_TEMP:
+		case FHT_FIELD_NIGHT_TEMP:
+		case FHT_FIELD_WINDOW_OPEN_TEMP:
+			err = json_append(buffer, size, &length, "%s\"%s\":%0.1f",
+					  sep, command->name,
+					  (float)value[field] * 0.5);
+			break;
+		case FHT_FIELD_IS_TEMP_HIGH:
+			if (!(valid & (1 << FHT_FIELD_IS_TEMP_LOW)))
+				break;
+			err = json_append(buffer, size, &length, "%s\"%s\":%0.2f",
+					  sep, command->name,
+					  ((float)value[FHT_FIELD_IS_TEMP_LOW] +
+					   (float)value[field] * 256) / 10.0);
+			break;
+		case FHT_FIELD_STATUS:
+			err = json_append(buffer, size, &length,
+					  "%s\"window\":\"%s\",\"battery\":\"%s\"",
+					  sep,
+					  value[field] & (1 << 5) ? "open" : "close",
+					  value[field] & (1 << 0) ? "empty" : "ok");
+			break;
+		case FHT_FIELD_YEAR:
+			err = json_append(buffer, size, &length, "%s\"%s\":%u",
+					  sep, command->name,
+					  FHT_YEAR_BASE + value[field]);
+			break;
+		case FHT_FIELD_MONTH:
+		case FHT_FIELD_DAY:
+		case FHT_FIELD_HOUR:
+		case FHT_FIELD_MINUTE:
+			err = json_append(buffer, size, &length, "%s\"%s\":%u",
+					  sep, command->name, value[field]);
+			break;
+		default:
+			/* valves */
+			err = json_append(buffer, size, &length, "%s\"%s\":%0.1f",
+					  sep, command->name,
+					  (float)value[field] * 100 / 255);
+			break;
+		}
 	}
+	if (!err)
+		err = json_append(buffer, size, &length, "}");
 
-	return -EINVAL;
+	return err ? err : length;
+}
+
+/*
+ * The status report of a known field, as if the FHT just sent it: the
+ * conversion of the command renders it from a copy of the device.
+ */
+int fht_field_message(const struct fht_device *device,
+		      const struct hauscode *hauscode, enum fht_field field,
+		      struct fht_message *message)
+{
+	const struct fht_command *command;
+	struct fht_message_raw raw = {0, 0, 0, 0};
+	struct fht_device copy;
+
+	command = field < FHT_FIELDS ? fht_field_commands[field] : NULL;
+	if (!command || !(device->valid & (1 << field)))
+		return -EINVAL;
+
+	memcpy(&copy, device, sizeof(copy));
+	if (field == FHT_FIELD_IS_TEMP_HIGH) {
+		if (!(device->valid & (1 << FHT_FIELD_IS_TEMP_LOW)))
+			return -EINVAL;
+		copy.pending.stamp = monotonic_ms();
+		copy.pending.value = device->value[FHT_FIELD_IS_TEMP_LOW];
+	}
+
+	memset(message, 0, sizeof(*message));
+	message->type = STATUS;
+	message->hauscode = *hauscode;
+	raw.cmd = fht_command_id(command);
+	raw.value = device->value[field];
+	raw.device = &copy;
+	raw.field = field;
+	message->raw.cmd = raw.cmd;
+	message->raw.value = raw.value;
+
+	report_topic(message, 0, FHT_TOPIC_COMMAND);
+	return command->output_conversion(message, &raw);
 }
 
-static int fht_send(int fd, const struct hauscode *hauscode,
-		    unsigned char memory, unsigned char value)
+static int fht_send(struct fhz_port *port, const struct hauscode *hauscode,
+		    const struct fht_register *regs, unsigned int count)
 {
-	const struct payload payload = {
+	struct payload payload = {
 		.tt = 0x04,
-		.len = 7,
-		.data = {0x02, 0x01, 0x83, hauscode->upper, hauscode->lower,
-			 memory, value},
+		.len = 5 + 2 * count,
+		.data = {0x02, 0x01, 0x83, hauscode->upper, hauscode->lower},
 	};
+	int i;
 
-	return fhz_send(fd, &payload);
+	for (i = 0; i < count; i++) {
+		payload.data[5 + 2 * i] = regs[i].memory;
+		payload.data[6 + 2 * i] = regs[i].value;
+	}
+
+	return fhz_send(port, &payload);
 }
 
-int fht_set(int fd, const struct hauscode *hauscode,
-	    const char *command, const char *payload)
+static int fht_enqueue(struct fht_queue *queue,
+		       const struct hauscode *hauscode,
+		       unsigned char memory, unsigned char value)
 {
-	const struct fht_command *fht_command;
-	unsigned char fht_val;
-	bool found = false;
+	unsigned long long now = monotonic_ms();
+	struct fht_request *request;
+	int i, j;
+
+	/*
+	 * Registers of the same device share one transmission. Last write
+	 * wins: only the latest value of a register goes on air.
+	 */
+	for (i = 0; i < queue->count; i++) {
+		request = &queue->requests[i];
+		if (request->hauscode.upper != hauscode->upper ||
+		    request->hauscode.lower != hauscode->lower)
+			continue;
+
+		for (j = 0; j < request->count; j++)
+			if (request->regs[j].memory == memory)
+				break;
+
+		if (j == request->count) {
+			if (request->count == ARRAY_SIZE(request->regs))
+				continue;
+			request->regs[request->count++].memory = memory;
+		}
+
+		request->regs[j].value = value;
+		request->due = now + FHT_QUEUE_DELAY;
+		if (request->due > request->stamp + FHT_QUEUE_MAX_DELAY)
+			request->due = request->stamp + FHT_QUEUE_MAX_DELAY;
+		return 0;
+	}
+
+	if (queue->count == ARRAY_SIZE(queue->requests))
+		return -ENOBUFS;
+
+	request = &queue->requests[queue->count++];
+	request->hauscode = *hauscode;
+	request->count = 1;
+	request->regs[0].memory = memory;
+	request->regs[0].value = value;
+	request->stamp = now;
+	request->due = now + FHT_QUEUE_DELAY;
+	request->trace = monotonic_ns();
+	metrics_add_shared(metrics.queue_depth, 1);
+
+	return 0;
+}
+
+void fht_queue_init(struct fht_queue *queue)
+{
+	pthread_mutex_init(&queue->lock, NULL);
+	queue->count = 0;
+}
+
+int fht_timeout(struct fhz_port *port)
+{
+	struct fht_queue *queue = &port->queue;
+	unsigned long long now = monotonic_ms();
+	unsigned long long due = ~0ULL;
+	int i;
+
+	pthread_mutex_lock(&queue->lock);
+	for (i = 0; i < queue->count; i++)
+		if (queue->requests[i].due < due)
+			due = queue->requests[i].due;
+	pthread_mutex_unlock(&queue->lock);
+
+	if (due == ~0ULL)
+		return -1;
+
+	return due > now ? due - now : 0;
+}
+
+int fht_flush(struct fhz_port *port)
+{
+	struct fht_queue *queue = &port->queue;
+	unsigned long long now = monotonic_ms();
+	struct fht_request *request;
+	int i, err = 0;
+
+	pthread_mutex_lock(&queue->lock);
+	for (i = 0; i < queue->count; ) {
+		request = &queue->requests[i];
+		if (request->due > now) {
+			i++;
+			continue;
+		}
+
+		err = fht_send(port, &request->hauscode, request->regs,
+			       request->count);
+		/* the tty is congested, retry later */
+		if (err == -EAGAIN)
+			break;
+
+		metrics_add_shared(metrics.queue_depth, -1);
+		if (!err) {
+			metrics_queue_delay(now - request->stamp);
+			trace_record(TRACE_TX, monotonic_ns() - request->trace);
+		}
+
+		memmove(request, request + 1,
+			(--queue->count - i) * sizeof(*request));
+		if (err)
+			break;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return err;
+}
+
+/*
+ * The caller holds the lock of the queue. The time is set as a whole or not
+ * at all: a full queue leaves it as it was.
+ */
+static int fht_enqueue_time(struct fht_queue *queue,
+			    const struct hauscode *hauscode,
+			    const struct tm *tm)
+{
+	const struct fht_register regs[] = {
+		{FHT_YEAR, tm->tm_year + 1900 - FHT_YEAR_BASE},
+		{FHT_MONTH, tm->tm_mon + 1},
+		{FHT_DAY, tm->tm_mday},
+		{FHT_HOUR, tm->tm_hour},
+		{FHT_MINUTE, tm->tm_min},
+	};
+	struct fht_request requests[FHT_QUEUE_SIZE];
+	unsigned int count = queue->count;
 	int i, err;
 
+	memcpy(requests, queue->requests, count * sizeof(*requests));
+
+	for (i = 0; i < ARRAY_SIZE(regs); i++) {
+		err = fht_enqueue(queue, hauscode, regs[i].memory,
+				  regs[i].value);
+		if (err)
+			goto rollback_out;
+	}
+
+	return 0;
+
+rollback_out:
+	metrics_add_shared(metrics.queue_depth, -(long)(queue->count - count));
+	memcpy(queue->requests, requests, count * sizeof(*requests));
+	queue->count = count;
+	return err;
+}
+
+int fht_set_time(struct fht_queue *queue, const struct hauscode *hauscode,
+		 const struct tm *tm)
+{
+	int err;
+
+	pthread_mutex_lock(&queue->lock);
+	err = fht_enqueue_time(queue, hauscode, tm);
+	pthread_mutex_unlock(&queue->lock);
+
+	return err;
+}
+
+/*
+ * Sets the clock of all FHTs seen, except the filtered ones of the
+ * neighbours. A full queue defers the rest: -EAGAIN until a later call
+ * queued the last one.
+ */
+int fht_sync_time(struct fhz_port *ports, unsigned int count)
+{
+	static unsigned int next;
+	struct fht_queue *queue;
+	struct hauscode hauscode;
+	time_t now = time(NULL);
+	struct tm tm;
+	int err;
+
+	localtime_r(&now, &tm);
+
+	for (; next < FHT_HAUSCODE_MAX * FHT_HAUSCODE_MAX; next++) {
+		hauscode.upper = next / FHT_HAUSCODE_MAX;
+		hauscode.lower = next % FHT_HAUSCODE_MAX;
+		if (!fht_device(&hauscode)->last_seen ||
+		    fhz_hauscode_filtered(&hauscode))
+			continue;
+
+		queue = &fhz_route(ports, count, &hauscode)->queue;
+		err = fht_set_time(queue, &hauscode, &tm);
+		if (err == -ENOBUFS)
+			return -EAGAIN;
+		if (err) {
+			next = 0;
+			return err;
+		}
+	}
+	next = 0;
+
+	return 0;
+}
+
+/* payload is either empty, "now" or "YYYY-MM-DD HH:MM" */
+static int fht_set_time_str(struct fht_queue *queue,
+			    const struct hauscode *hauscode,
+			    const char *payload)
+{
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+
+	if (payload[0] && strcasecmp(payload, "now")) {
+		if (sscanf(payload, "%d-%d-%d %d:%d", &tm.tm_year, &tm.tm_mon,
+			   &tm.tm_mday, &tm.tm_hour, &tm.tm_min) != 5)
+			return -EINVAL;
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+	}
+
+	if (tm.tm_year + 1900 < FHT_YEAR_BASE ||
+	    tm.tm_year + 1900 > FHT_YEAR_BASE + 255 ||
+	    tm.tm_mon < 0 || tm.tm_mon > 11 ||
+	    tm.tm_mday < 1 || tm.tm_mday > 31 ||
+	    tm.tm_hour < 0 || tm.tm_hour > 23 ||
+	    tm.tm_min < 0 || tm.tm_min > 59)
+		return -ERANGE;
+
+	return fht_enqueue_time(queue, hauscode, &tm);
+}
+
+static const struct fht_command fht_command_time = {
+	.name = "time",
+	.enqueue = fht_set_time_str,
+};
+
+/*
+ * Perfect hash of all command names that are accepted for set requests.
+ * fht_init() searches for a seed that maps every name to its own slot,
+ * so a lookup costs one pass over the name and a single strcmp().
+ */
+#define FHT_NAMES_SIZE 128
+
+static const struct fht_command *fht_names[FHT_NAMES_SIZE];
+static unsigned int fht_names_seed;
+
+static unsigned int fht_name_hash(const char *name, unsigned int seed)
+{
+	unsigned int hash = seed;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+
+	return hash % FHT_NAMES_SIZE;
+}
+
+static bool fht_names_insert(const struct fht_command *command)
+{
+	const struct fht_command **slot;
+
+	slot = &fht_names[fht_name_hash(command->name, fht_names_seed)];
+	if (*slot)
+		return false;
+
+	*slot = command;
+	return true;
+}
+
+int fht_init(void)
+{
+	const struct fht_command *fht_command;
+	bool perfect;
+	int i;
+
 	for_each_fht_command(fht_commands, fht_command, i)
-		if (fht_command->name && !strcmp(fht_command->name, command)) {
-			found = true;
-			break;
+		if (fht_command->name && fht_command->field) {
+			fht_slot_topics[fht_command->field] = fht_command->name;
+			fht_field_commands[fht_command->field] = fht_command;
 		}
 
-	if (!found)
-		return -EINVAL;
+	for (fht_names_seed = 2166136261u; ; fht_names_seed++) {
+		memset(fht_names, 0, sizeof(fht_names));
+
+		perfect = fht_names_insert(&fht_command_time);
+		for_each_fht_command(fht_commands, fht_command, i)
+			if (perfect && fht_command->name)
+				perfect = fht_names_insert(fht_command);
+
+		if (perfect)
+			return 0;
+
+		if (fht_names_seed == 2166136261u + 100000)
+			return -EINVAL;
+	}
+}
+
+const struct fht_command *fht_command_lookup(const char *name)
+{
+	const struct fht_command *fht_command;
+
+	fht_command = fht_names[fht_name_hash(name, fht_names_seed)];
+	if (!fht_command || strcmp(fht_command->name, name))
+		return NULL;
+
+	return fht_command;
+}
+
+int fht_set(struct fht_queue *queue, const struct hauscode *hauscode,
+	    const struct fht_command *fht_command, const char *payload)
+{
+	int err;
+
+	pthread_mutex_lock(&queue->lock);
+	if (fht_command->enqueue) {
+		err = fht_command->enqueue(queue, hauscode, payload);
+		goto unlock_out;
+	}
 
 	err = fht_command->input_conversion(payload);
 	if (err < 0)
-		return err;
+		goto unlock_out;
 
-	fht_val = err;
+	err = fht_enqueue(queue, hauscode, fht_command_id(fht_command), err);
 
-	return fht_send(fd, hauscode, fht_command->function_id, fht_val);
+unlock_out:
+	pthread_mutex_unlock(&queue->lock);
+	return err;
 }
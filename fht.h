@@ -12,32 +12,176 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
+struct fht_command;
+struct fhz_port;
 struct payload;
+struct payload_view;
 
 struct hauscode {
 	unsigned char upper;
 	unsigned char lower;
 } __attribute__((packed));
 
+/* both halves of a hauscode range from 00 to 99 */
+#define FHT_HAUSCODE_MAX 100
+
+/* registers we keep track of in the device state */
+enum fht_field {
+	FHT_FIELD_NONE = 0,
+	FHT_FIELD_IS_VALVE,
+	FHT_FIELD_VALVE_1,
+	FHT_FIELD_VALVE_2,
+	FHT_FIELD_VALVE_3,
+	FHT_FIELD_VALVE_4,
+	FHT_FIELD_VALVE_5,
+	FHT_FIELD_VALVE_6,
+	FHT_FIELD_VALVE_7,
+	FHT_FIELD_VALVE_8,
+	FHT_FIELD_MODE,
+	FHT_FIELD_DESIRED_TEMP,
+	FHT_FIELD_IS_TEMP_LOW,
+	FHT_FIELD_IS_TEMP_HIGH,
+	FHT_FIELD_STATUS,
+	FHT_FIELD_MANU_TEMP,
+	FHT_FIELD_YEAR,
+	FHT_FIELD_MONTH,
+	FHT_FIELD_DAY,
+	FHT_FIELD_HOUR,
+	FHT_FIELD_MINUTE,
+	FHT_FIELD_DAY_TEMP,
+	FHT_FIELD_NIGHT_TEMP,
+	FHT_FIELD_WINDOW_OPEN_TEMP,
+	FHT_FIELDS,
+};
+
+struct fht_device {
+	/*
+	 * Sequence count, odd while the serial side updates the device. Other
+	 * threads only look at copies, see fht_device_read().
+	 */
+	atomic_uint seq;
+	/* wall clock time of the last valid frame, 0 if never seen */
+	time_t last_seen;
+	/* index of the FHZ that heard the device last */
+	unsigned char port;
+	/* first half of a multi-frame value, waiting for the second one */
+	struct {
+		unsigned long long stamp;
+		unsigned char value;
+	} pending;
+	/* bitmap of valid fields */
+	unsigned int valid;
+	/* bitmap of fields restored from a snapshot, not confirmed yet */
+	unsigned int stale;
+	unsigned char value[FHT_FIELDS];
+} __attribute__((aligned(64)));
+
+/* only the thread that decodes updates devices */
+static inline void fht_device_write_begin(struct fht_device *device)
+{
+	atomic_fetch_add_explicit(&device->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void fht_device_write_end(struct fht_device *device)
+{
+	atomic_fetch_add_explicit(&device->seq, 1, memory_order_release);
+}
+
+/* outbound requests, coalesced per hauscode and register */
+#define FHT_QUEUE_SIZE 64
+/* max. number of registers within one transmission */
+#define FHT_SEND_MAX 8
+/* settle time of a request before it goes on air, in ms */
+#define FHT_QUEUE_DELAY 500
+/* ...but a request is never deferred for longer than that */
+#define FHT_QUEUE_MAX_DELAY 3000
+
+struct fht_register {
+	unsigned char memory;
+	unsigned char value;
+};
+
+struct fht_queue {
+	/* requests are enqueued and flushed from different threads */
+	pthread_mutex_t lock;
+	unsigned int count;
+	struct fht_request {
+		struct hauscode hauscode;
+		unsigned char count;
+		struct fht_register regs[FHT_SEND_MAX];
+		unsigned long long stamp;
+		unsigned long long due;
+		/* monotonic ns of the first request, for latency tracing */
+		unsigned long long trace;
+	} requests[FHT_QUEUE_SIZE];
+};
+
+/* topics of reports are static, see fht_report_topic() */
+enum fht_topic {
+	FHT_TOPIC_NONE,
+	/* the name of the command */
+	FHT_TOPIC_COMMAND,
+	FHT_TOPIC_WINDOW,
+	FHT_TOPIC_BATTERY,
+	FHT_TOPIC_SYNCTIME,
+	/* valve/<register> and valve/<register>/offset */
+	FHT_TOPIC_VALVE,
+	FHT_TOPIC_VALVE_OFFSET,
+};
+
+/* valve/0 to valve/8 */
+#define FHT_VALVES 9
+
+/*
+ * Dense index of the topic of a report, for per-device caches: the field
+ * of the command, the fixed topics, then the valve topics by register.
+ */
+enum fht_slot {
+	FHT_SLOT_WINDOW = FHT_FIELDS,
+	FHT_SLOT_BATTERY,
+	FHT_SLOT_SYNCTIME,
+	FHT_SLOT_VALVE,
+	FHT_SLOT_VALVE_OFFSET = FHT_SLOT_VALVE + FHT_VALVES,
+	FHT_SLOTS = FHT_SLOT_VALVE_OFFSET + FHT_VALVES,
+};
+
 struct fht_message {
 	enum {STATUS, ACK} type;
 	struct hauscode hauscode;
+	/* the message updated the device state */
+	bool state;
+	/* the register as received, for the binary encoding */
 	struct {
-		char topic[16];
+		unsigned char cmd;
+		unsigned char status;
+		unsigned char value;
+		/* the report value is fixed * 10^exponent */
+		bool scaled;
+		signed char exponent;
+		int fixed;
+		/* wall clock of reception, in ms */
+		unsigned long long time;
+	} raw;
+	struct {
+		/* enum fht_topic, an index survives the spool */
+		unsigned char topic;
 		char value[16];
+		unsigned char length; /* of value */
 	} report[2];
 };
 
-static inline int hauscode_from_string(const char *string,
-				       struct hauscode *hauscode)
+/* parse the four digits at the beginning of string */
+static inline int hauscode_parse(const char *string, struct hauscode *hauscode)
 {
 	int i;
 
-	if (strlen(string) != 4)
-		return -EINVAL;
-
 	for (i = 0; i < 4; i++)
 		if (!isdigit(string[i]))
 			return -EINVAL;
@@ -50,6 +194,39 @@ static inline int hauscode_from_string(const char *string,
 	return 0;
 }
 
-int fht_decode(const struct payload *payload, struct fht_message *message);
-int fht_set(int fd, const struct hauscode *hauscode,
-	    const char *command, const char *payload);
+static inline int hauscode_from_string(const char *string,
+				       struct hauscode *hauscode)
+{
+	if (strlen(string) != 4)
+		return -EINVAL;
+
+	return hauscode_parse(string, hauscode);
+}
+
+static inline bool hauscode_valid(const struct hauscode *hauscode)
+{
+	return hauscode->upper < FHT_HAUSCODE_MAX &&
+	       hauscode->lower < FHT_HAUSCODE_MAX;
+}
+
+struct fht_device *fht_device(const struct hauscode *hauscode);
+int fht_device_read(const struct hauscode *hauscode, struct fht_device *copy);
+int fht_decode(const struct payload_view *payload,
+	       struct fht_message *message);
+int fht_report_slot(const struct fht_message *message, int no);
+const char *fht_slot_topic(unsigned int slot);
+const char *fht_report_topic(const struct fht_message *message, int no);
+int fht_state_json(const struct hauscode *hauscode, char *buffer, size_t size);
+int fht_field_message(const struct fht_device *device,
+		      const struct hauscode *hauscode, enum fht_field field,
+		      struct fht_message *message);
+int fht_init(void);
+const struct fht_command *fht_command_lookup(const char *name);
+int fht_set(struct fht_queue *queue, const struct hauscode *hauscode,
+	    const struct fht_command *command, const char *payload);
+int fht_set_time(struct fht_queue *queue, const struct hauscode *hauscode,
+		 const struct tm *tm);
+int fht_sync_time(struct fhz_port *ports, unsigned int count);
+void fht_queue_init(struct fht_queue *queue);
+int fht_timeout(struct fhz_port *port);
+int fht_flush(struct fhz_port *port);
@@ -14,18 +14,33 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "fhz.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define FHZ_MAGIC 0x81
 
 #define BAUDRATE B9600
 
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define FHZ_FILTER_BITS (FHT_HAUSCODE_MAX * FHT_HAUSCODE_MAX)
+
+/* a set bit drops all frames of that hauscode */
+static unsigned long fhz_filter_map[(FHZ_FILTER_BITS + BITS_PER_LONG - 1) /
+				    BITS_PER_LONG];
+static enum {
+	FHZ_FILTER_NONE,
+	FHZ_FILTER_ALLOW,
+	FHZ_FILTER_DENY,
+} fhz_filter_mode;
+
 #ifdef DEBUG
 static inline void hexdump(const unsigned char *data, size_t length)
 {
@@ -38,96 +53,305 @@ static inline void hexdump(const unsigned char *data, size_t length)
 #define hexdump(...)
 #endif
 
-static int fhz_receive(int fd, struct payload *payload)
+static inline unsigned int rx_level(const struct fhz_port *port)
 {
-	unsigned char buffer[256 + 2];
-	unsigned char *payload_data;
-	struct timeval tv = {0, 0};
-	unsigned char payload_len;
-	const int maxfd = fd + 1;
-	unsigned char bc; /* the dump checksum */
-	fd_set readset;
-	ssize_t length;
-	int ret;
-	int i;
+	return port->rx.head - port->rx.tail;
+}
 
-	FD_ZERO(&readset);
-	FD_SET(fd, &readset);
+static inline unsigned char rx_peek(const struct fhz_port *port,
+				    unsigned int offset)
+{
+	return port->rx.buffer[(port->rx.tail + offset) & (FHZ_RX_SIZE - 1)];
+}
 
-	errno = EAGAIN;
-	ret = select(maxfd, &readset, NULL, NULL, &tv);
-	if (ret <= 0) /* on error and timeout */
-		return -errno;
+/*
+ * The next length bytes in one piece. Only the part of a frame that wraps
+ * around is copied, to the slack behind the ring. Valid until the next
+ * receive.
+ */
+static const unsigned char *rx_linear(struct fhz_port *port,
+				      unsigned int length)
+{
+	unsigned int start = port->rx.tail & (FHZ_RX_SIZE - 1);
 
-	/* on receive, just wait a bit... */
-	usleep(300000);
+	if (start + length > FHZ_RX_SIZE)
+		memcpy(port->rx.buffer + FHZ_RX_SIZE, port->rx.buffer,
+		       start + length - FHZ_RX_SIZE);
 
-	length = read(fd, buffer, 2);
-	if (length < 2) {
-		if (length == -1) {
-			error("Read from serial fail: %s\n", strerror(errno));
-			return -errno;
-		} else {
-			error("Packet shorter than four bytes: %zd\n", length);
-			return -EINVAL;
-		}
-	}
+	return port->rx.buffer + start;
+}
 
-	if (buffer[0] != FHZ_MAGIC) {
-		fprintf(stderr, "Invalid packet magic\n");
-		return -EINVAL;
+/*
+ * Bytes of a frame arrive back-to-back. If the line was silent for too
+ * long, the pending frame will never complete: its length byte was garbage
+ * or we lost bytes. Drop its magic and resync.
+ */
+static void rx_expire(struct fhz_port *port, unsigned long long now)
+{
+	if (rx_level(port) && now - port->rx.last > FHZ_RX_TIMEOUT) {
+		fprintf(stderr, "Incomplete packet timed out\n");
+		metrics_inc(metrics.rx_timeouts);
+		port->rx.tail++;
 	}
+}
+
+/*
+ * Without new bytes, nothing else would expire the pending frame. Replays
+ * as fast as possible know from the capture that the line was silent.
+ */
+void fhz_expire(struct fhz_port *port, bool silent)
+{
+	rx_expire(port, silent ? port->rx.last + FHZ_RX_TIMEOUT + 1 :
+				 monotonic_ms());
+}
+
+/* ms until a pending partial frame expires, -1 if there is none */
+int fhz_rx_timeout(const struct fhz_port *port)
+{
+	unsigned long long now = monotonic_ms();
+	unsigned long long due = port->rx.last + FHZ_RX_TIMEOUT + 1;
+
+	if (!rx_level(port))
+		return -1;
+
+	return due > now ? due - now : 0;
+}
 
-	length = read(fd, buffer + 2, buffer[1]);
-	if (length < buffer[1]) {
+int fhz_feed(struct fhz_port *port, const unsigned char *data,
+	     unsigned int length)
+{
+	unsigned long long now = monotonic_ms();
+	unsigned int start, chunk;
+
+	rx_expire(port, now);
+
+	if (length > FHZ_RX_SIZE - rx_level(port))
+		return -ENOBUFS;
+
+	start = port->rx.head & (FHZ_RX_SIZE - 1);
+	chunk = FHZ_RX_SIZE - start;
+	if (chunk > length)
+		chunk = length;
+
+	capture_data(CAPTURE_RX, data, length);
+	memcpy(port->rx.buffer + start, data, chunk);
+	memcpy(port->rx.buffer, data + chunk, length - chunk);
+	port->rx.head += length;
+	port->rx.last = now;
+	port->rx.available = monotonic_ns();
+
+	return 0;
+}
+
+int fhz_receive(struct fhz_port *port)
+{
+	unsigned long long now = monotonic_ms();
+	unsigned int start, space;
+	ssize_t length;
+
+	rx_expire(port, now);
+	port->rx.available = monotonic_ns();
+
+	for (;;) {
+		start = port->rx.head & (FHZ_RX_SIZE - 1);
+		space = FHZ_RX_SIZE - rx_level(port);
+		if (space > FHZ_RX_SIZE - start)
+			space = FHZ_RX_SIZE - start;
+		if (!space)
+			break;
+
+		length = read(port->fd, port->rx.buffer + start, space);
 		if (length == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
 			error("Read from serial fail: %s\n", strerror(errno));
+			metrics_inc(metrics.rx_errors);
 			return -errno;
-		} else {
-			error("Packet shorter expected: got %zd, expected %u\n",
-			      length, buffer[1]);
-			return -EINVAL;
+		} else if (length == 0) {
+			metrics_inc(metrics.rx_errors);
+			return -EIO;
 		}
+
+		/* raw, so that replays see the garbage and torn frames too */
+		capture_data(CAPTURE_RX, port->rx.buffer + start, length);
+		port->rx.head += length;
+		port->rx.last = now;
 	}
 
-	length += 2;
+	return 0;
+}
+
+/*
+ * Cut the next complete frame out of the receive buffer. Frames look like
+ *   FHZ_MAGIC | len | tt | checksum | data[len - 2]
+ * Anything that doesn't look like that is skipped byte by byte, until a
+ * magic with a matching length and checksum shows up again.
+ */
+static int fhz_frame(struct fhz_port *port, struct payload_view *payload)
+{
+	const unsigned char *frame;
+	unsigned int length, skipped;
+	unsigned char bc; /* the dump checksum */
+	int i;
+
+	for (skipped = 0; rx_level(port); port->rx.tail++, skipped++) {
+		if (rx_peek(port, 0) != FHZ_MAGIC)
+			continue;
+
+		if (rx_level(port) < 2)
+			break;
+
+		length = rx_peek(port, 1);
+		if (length < 2)
+			continue;
+
+		if (rx_level(port) < length + 2)
+			break;
+
+		frame = rx_linear(port, length + 2);
+
+		bc = 0;
+		for (i = 4; i < length + 2; i++)
+			bc += frame[i];
+
+		if (bc != frame[3]) {
+			fprintf(stderr, "Packet checksum mismatch\n");
+			metrics_inc(metrics.rx_checksum_errors);
+			continue;
+		}
+
+		if (skipped) {
+			error("Invalid packet magic, skipped %u bytes\n",
+			      skipped);
+			metrics_inc(metrics.rx_magic_errors);
+		}
+
+		hexdump(frame, length + 2);
+		metrics_inc(metrics.rx_frames[frame[2]]);
+
+		port->rx.tail += length + 2;
 
-	hexdump(buffer, length);
+		payload->tt = frame[2];
+		payload->len = length - 2;
+		payload->data = frame + 4;
 
-	if (length < 4) {
-		fprintf(stderr, "Packet misses type or crc\n");
+		return 0;
+	}
+
+	if (skipped) {
+		error("Invalid packet magic, skipped %u bytes\n", skipped);
+		metrics_inc(metrics.rx_magic_errors);
 		return -EINVAL;
 	}
 
-	payload_data = buffer + 4;
-	payload_len = length - 4;
+	return -ENODATA;
+}
 
-	bc = 0;
-	for (i = 0; i < payload_len; i++)
-		bc += payload_data[i];
+/*
+ * Comma separated hauscodes, e.g. 9601,1234. Either only the given FHTs are
+ * allowed, or they are denied, but not both.
+ */
+int fhz_filter(const char *hauscodes, bool allow)
+{
+	struct hauscode hauscode;
+	const char *pos;
+	unsigned int hc;
+
+	/* exactly four digits each, nothing is applied before all are valid */
+	for (pos = hauscodes; ; pos += 5) {
+		if (hauscode_parse(pos, &hauscode) ||
+		    (pos[4] && pos[4] != ','))
+			return -EINVAL;
+		if (!pos[4])
+			break;
+	}
 
-	if (bc != buffer[3]) {
-		fprintf(stderr, "Packet checksum mismatch\n");
+	if (fhz_filter_mode == FHZ_FILTER_NONE && allow)
+		memset(fhz_filter_map, 0xff, sizeof(fhz_filter_map));
+	else if (fhz_filter_mode != FHZ_FILTER_NONE &&
+		 fhz_filter_mode != (allow ? FHZ_FILTER_ALLOW : FHZ_FILTER_DENY))
 		return -EINVAL;
+	fhz_filter_mode = allow ? FHZ_FILTER_ALLOW : FHZ_FILTER_DENY;
+
+	for (pos = hauscodes; ; pos += 5) {
+		hauscode_parse(pos, &hauscode);
+		hc = hauscode.upper * FHT_HAUSCODE_MAX + hauscode.lower;
+		if (allow)
+			fhz_filter_map[hc / BITS_PER_LONG] &=
+				~(1UL << (hc % BITS_PER_LONG));
+		else
+			fhz_filter_map[hc / BITS_PER_LONG] |=
+				1UL << (hc % BITS_PER_LONG);
+		if (!pos[4])
+			break;
 	}
 
-	payload->tt = buffer[2];
-	memcpy(payload->data, payload_data, payload_len);
-	payload->len = payload_len;
-
 	return 0;
 }
 
-int fhz_handle(int fd, struct fhz_message *message)
+bool fhz_hauscode_filtered(const struct hauscode *hauscode)
+{
+	unsigned int hc;
+
+	if (fhz_filter_mode == FHZ_FILTER_NONE || !hauscode_valid(hauscode))
+		return false;
+
+	hc = hauscode->upper * FHT_HAUSCODE_MAX + hauscode->lower;
+	return fhz_filter_map[hc / BITS_PER_LONG] &
+	       (1UL << (hc % BITS_PER_LONG));
+}
+
+/*
+ * Only FHT frames carry a hauscode, at the same place in status reports and
+ * acks. Anything else is left to the decoder.
+ */
+static bool fhz_filtered(const struct payload_view *payload)
 {
-	struct payload payload;
+	const unsigned char *data = payload->data;
+	unsigned int hc;
+
+	if (fhz_filter_mode == FHZ_FILTER_NONE || payload->len < 6 ||
+	    data[1] != 0x09 || data[3] != 0x01 ||
+	    !fhz_hauscode_filtered((const struct hauscode *)(data + 4)))
+		return false;
+
+	hc = data[4] * FHT_HAUSCODE_MAX + data[5];
+
+	metrics_inc(metrics.filtered[hc]);
+	return true;
+}
+
+int fhz_handle(struct fhz_port *port, struct fhz_message *message)
+{
+	struct fht_device *device;
+	struct payload_view payload;
 	int err;
 
-	err = fhz_receive(fd, &payload);
-	if (err)
-		return err;
+	/* frames of foreign FHTs never reach the decoder */
+	do {
+		err = fhz_frame(port, &payload);
+		if (err)
+			return err;
+	} while (fhz_filtered(&payload));
 
+	message->stamp.available = port->rx.available;
+	message->stamp.received = monotonic_ns();
 	err = fht_decode(&payload, &message->fht);
+	message->stamp.decoded = monotonic_ns();
+	trace_record(TRACE_RX_FRAME,
+		     message->stamp.received - message->stamp.available);
+	trace_record(TRACE_RX_DECODE,
+		     message->stamp.decoded - message->stamp.received);
+	if (!err || err == -EAGAIN) {
+		/* answers of the device will most likely arrive here again */
+		device = fht_device(&message->fht.hauscode);
+		if (device && device->port != port->index) {
+			fht_device_write_begin(device);
+			device->port = port->index;
+			fht_device_write_end(device);
+		}
+	}
+
 	if (!err) {
 		message->machine = FHT;
 		return 0;
@@ -140,11 +364,72 @@ int fhz_handle(int fd, struct fhz_message *message)
 	return err;
 }
 
-int fhz_send(int fd, const struct payload *payload)
+/* the FHZ that heard the device last, or the first one */
+struct fhz_port *fhz_route(struct fhz_port *ports, unsigned int count,
+			   const struct hauscode *hauscode)
 {
-	unsigned char buffer[256-2];
+	struct fht_device device;
+
+	/* called by the publisher as well */
+	if (fht_device_read(hauscode, &device) || !device.last_seen ||
+	    device.port >= count)
+		return &ports[0];
+
+	return &ports[device.port];
+}
+
+/*
+ * Writes what is left of the current frame. Returns -EAGAIN while the tty
+ * doesn't take all of it.
+ */
+int fhz_transmit(struct fhz_port *port)
+{
+	ssize_t ret;
+
+	if (!fhz_tx_pending(port))
+		return 0;
+
+#ifndef NO_SEND
+	ret = write(port->fd, port->tx.buffer + port->tx.sent,
+		    port->tx.length - port->tx.sent);
+	if (ret == -1 && errno == EAGAIN) {
+		metrics_inc(metrics.tx_congested);
+		return -EAGAIN;
+	}
+	if (ret <= 0) {
+		fprintf(stderr, "Error sending FHZ sequence\n");
+		metrics_inc(metrics.tx_errors);
+		port->tx.length = port->tx.sent = 0;
+		return ret ? -errno : -EIO;
+	}
+#else
+	ret = port->tx.length - port->tx.sent;
+#endif
+	port->tx.sent += ret;
+	if (fhz_tx_pending(port)) {
+		metrics_inc(metrics.tx_congested);
+		return -EAGAIN;
+	}
+
+	port->tx.length = port->tx.sent = 0;
+	return 0;
+}
+
+/*
+ * A frame the tty took only partially counts as sent, its rest goes out
+ * with fhz_transmit() once the tty is writable again.
+ */
+int fhz_send(struct fhz_port *port, const struct payload *payload)
+{
+	unsigned char *buffer = port->tx.buffer;
 	unsigned char bc;
-	int i, ret;
+	int i, err;
+
+	/* frames must not interleave */
+	if (fhz_tx_pending(port)) {
+		metrics_inc(metrics.tx_congested);
+		return -EAGAIN;
+	}
 
 	bc = 0;
 	for (i = 0; i < payload->len; i++)
@@ -157,26 +442,30 @@ int fhz_send(int fd, const struct payload *payload)
 	memcpy(buffer + 4, payload->data, payload->len);
 
 	hexdump(buffer, payload->len + 4);
-
-#ifndef NO_SEND
-	ret = write(fd, buffer, payload->len + 4);
-	if (ret != payload->len + 4) {
-		fprintf(stderr, "Error sending FHZ sequence\n");
-		return -EINVAL;
+	capture_data(CAPTURE_TX, buffer, payload->len + 4);
+
+	port->tx.length = payload->len + 4;
+	port->tx.sent = 0;
+	err = fhz_transmit(port);
+	/* nothing of it went out, so the request may retry */
+	if (err == -EAGAIN && !port->tx.sent) {
+		port->tx.length = 0;
+		return -EAGAIN;
 	}
-#else
-	(void)ret; /* surpress compiler warning */
-#endif
+	if (err && err != -EAGAIN)
+		return err;
+
+	metrics_inc(metrics.tx_frames[payload->tt]);
 
 	return 0;
 }
 
-int fhz_open_serial(const char *device)
+int fhz_open_serial(struct fhz_port *port, const char *device)
 {
 	struct termios tty;
 	int err, fd;
 
-        fd = open(device, O_RDWR | O_NOCTTY);
+        fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
         if (fd == -1) {
 		error("opening %s: %s\n", device, strerror(errno));
 		return -errno;
@@ -222,7 +511,11 @@ int fhz_open_serial(const char *device)
 
 	}
 
-	return fd;
+	memset(port, 0, sizeof(*port));
+	port->fd = fd;
+	fht_queue_init(&port->queue);
+
+	return 0;
 
 close_out:
 	close(fd);
@@ -10,6 +10,8 @@
  * the COPYING file in the top-level directory.
  */
 
+#include <time.h>
+
 #include "fht.h"
 
 #define ARRAY_SIZE(a) sizeof(a) / sizeof(a[0])
@@ -19,6 +21,16 @@
 #define FHZ_MAGIC 0x81
 #define BAUDRATE B9600
 
+/* receive ring buffer size, must be a power of two */
+#define FHZ_RX_SIZE 1024
+/* magic, length and up to 255 bytes */
+#define FHZ_FRAME_MAX (256 + 1)
+/* max. silence within a frame before it is dropped, in ms */
+#define FHZ_RX_TIMEOUT 200
+
+/* max. number of FHZs driven by one process */
+#define FHZ_PORTS_MAX 8
+
 #define error(...) \
 	do { \
 		char error_buffer[128]; \
@@ -26,21 +38,88 @@
 		fprintf(stderr, error_buffer); \
 	} while(0)
 
+static inline unsigned long long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned long long monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 struct payload {
 	unsigned char tt;
 	unsigned char len;
 	unsigned char data[256];
 };
 
+/* a received payload, in place in the receive buffer */
+struct payload_view {
+	unsigned char tt;
+	unsigned char len;
+	const unsigned char *data;
+};
+
 struct fhz_message {
 	enum {
 		FHT,
 	} machine;
+	/* monotonic ns, for latency tracing */
+	struct {
+		/* the serial port became readable */
+		unsigned long long available;
+		/* the frame was cut from the receive buffer */
+		unsigned long long received;
+		unsigned long long decoded;
+	} stamp;
 	union {
 		struct fht_message fht;
 	};
 };
 
-int fhz_open_serial(const char *device);
-int fhz_send(int fd, const struct payload *payload);
-int fhz_handle(int fd, struct fhz_message *message);
+struct fhz_port {
+	int fd;
+	/* position within the array of all ports */
+	unsigned int index;
+	struct fht_queue queue;
+	struct {
+		/* frames that wrap around are completed behind the ring */
+		unsigned char buffer[FHZ_RX_SIZE + FHZ_FRAME_MAX];
+		/* free running, masked on access */
+		unsigned int head, tail;
+		unsigned long long last;
+		/* of the latest read, in ns */
+		unsigned long long available;
+	} rx;
+	struct {
+		/* the rest of a frame the tty took only partially */
+		unsigned char buffer[256 - 2];
+		unsigned int length, sent;
+	} tx;
+};
+
+int fhz_open_serial(struct fhz_port *port, const char *device);
+int fhz_send(struct fhz_port *port, const struct payload *payload);
+int fhz_transmit(struct fhz_port *port);
+
+static inline bool fhz_tx_pending(const struct fhz_port *port)
+{
+	return port->tx.sent < port->tx.length;
+}
+int fhz_receive(struct fhz_port *port);
+void fhz_expire(struct fhz_port *port, bool silent);
+int fhz_rx_timeout(const struct fhz_port *port);
+int fhz_feed(struct fhz_port *port, const unsigned char *data,
+	     unsigned int length);
+int fhz_handle(struct fhz_port *port, struct fhz_message *message);
+int fhz_filter(const char *hauscodes, bool allow);
+bool fhz_hauscode_filtered(const struct hauscode *hauscode);
+struct fhz_port *fhz_route(struct fhz_port *ports, unsigned int count,
+			   const struct hauscode *hauscode);
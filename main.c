@@ -11,32 +11,644 @@
  */
 
 #include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "fhz.h"
+#include "metrics.h"
 #include "mqtt.h"
+#include "pipeline.h"
+#include "snapshot.h"
+#include "spool.h"
+#include "trace.h"
 
 #define MQTT_DEFAULT_PORT 1883
 #define MQTT_DEFAULT_HOSTNAME "localhost"
+#define MQTT_DEFAULT_HEARTBEAT 900
+#define MQTT_DEFAULT_INFLIGHT 20
+#define SNAPSHOT_DEFAULT_INTERVAL 60
+
+static struct fhz_port fhz_ports[FHZ_PORTS_MAX];
+static char *usb_ports[FHZ_PORTS_MAX];
+static unsigned int fhz_count;
+
+static bool replaying, replay_done;
+static struct replay replay;
+
+static unsigned int sync_interval;
+static unsigned long long next_sync;
+/* the last sync didn't fit into the queues yet */
+static bool sync_pending;
+
+static unsigned int snapshot_interval = SNAPSHOT_DEFAULT_INTERVAL;
+static unsigned long long next_snapshot;
+
+/* listening socket of the metrics endpoint, ignored by poll() if unused */
+static int metrics_fd = -1;
+
+/* set by SIGUSR1, interrupts poll() */
+static volatile sig_atomic_t trace_requested;
+/* set by SIGTERM and SIGINT, the bridge shuts down cleanly */
+static volatile sig_atomic_t terminate;
+
+/* merge two poll() timeouts, where -1 means infinite */
+static int min_timeout(int a, int b)
+{
+	if (a < 0)
+		return b;
+	if (b < 0)
+		return a;
+	return a < b ? a : b;
+}
+
+static int due_in(unsigned long long due)
+{
+	unsigned long long now = monotonic_ms();
+
+	return due > now ? due - now : 0;
+}
+
+static int serial_timeout(void)
+{
+	int timeout = -1;
+	unsigned int i;
+
+	for (i = 0; i < fhz_count; i++) {
+		timeout = min_timeout(timeout, fht_timeout(&fhz_ports[i]));
+		/* frames behind a torn one wait for it to expire */
+		timeout = min_timeout(timeout, fhz_rx_timeout(&fhz_ports[i]));
+	}
+	if (sync_interval)
+		timeout = min_timeout(timeout, due_in(next_sync));
+	if (snapshot_enabled() && snapshot_interval)
+		timeout = min_timeout(timeout, due_in(next_snapshot));
+	if (replaying)
+		timeout = min_timeout(timeout, replay_timeout(&replay));
+
+	return timeout;
+}
+
+static void serial_poll(struct pollfd *fds)
+{
+	unsigned int i;
+
+	for (i = 0; i < fhz_count; i++) {
+		/* a negative fd, e.g. while replaying, is ignored by poll() */
+		fds[i].fd = fhz_ports[i].fd;
+		fds[i].events = POLLIN;
+		/* due requests are only pending if the tty was congested */
+		if (!fht_timeout(&fhz_ports[i]) ||
+		    fhz_tx_pending(&fhz_ports[i]))
+			fds[i].events |= POLLOUT;
+		fds[i].revents = 0;
+	}
+}
+
+static int serial_receive(const struct pollfd *fds)
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < fhz_count; i++) {
+		if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			error("Serial port %s vanished\n", usb_ports[i]);
+			return -EIO;
+		}
+
+		if (fds[i].revents & POLLIN) {
+			err = fhz_receive(&fhz_ports[i]);
+			if (err) {
+				error("Serial port %s failure: %s\n",
+				      usb_ports[i], strerror(-err));
+				return err;
+			}
+		} else {
+			fhz_expire(&fhz_ports[i], false);
+		}
+	}
+
+	if (replaying && !replay_done) {
+		err = replay_feed(&replay, &fhz_ports[0]);
+		if (err == -ENODATA) {
+			replay_done = true;
+		} else if (err) {
+			error("Replay failure: %s\n", strerror(-err));
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/* the capture is exhausted, and a torn frame at its end expired */
+static bool replay_drained(void)
+{
+	return replay_done && fhz_rx_timeout(&fhz_ports[0]) < 0;
+}
+
+/*
+ * Emit every frame that completed within the buffers, either directly to
+ * the broker or to the publisher thread.
+ */
+static void serial_handle(struct mosquitto *mosquitto,
+			  struct pipeline *pipeline)
+{
+	struct fhz_message message;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < fhz_count; i++)
+		while ((err = fhz_handle(&fhz_ports[i], &message)) !=
+		       -ENODATA) {
+			if (err && err != -EAGAIN) {
+				error("Error decoding packet: %s\n",
+				      strerror(-err));
+			} else if (!err && pipeline) {
+				pipeline_push(pipeline, &message);
+			} else if (!err) {
+				err = mqtt_publish(mosquitto, &message);
+				if (err)
+					fprintf(stderr, "mqtt: unable to "
+						"publish FHZ message\n");
+			}
+		}
+}
+
+static void serial_transmit(void)
+{
+	unsigned int i;
+	int err;
+
+	if (sync_interval && !due_in(next_sync)) {
+		sync_pending = true;
+		next_sync += sync_interval * 60000ULL;
+	}
+	if (sync_pending) {
+		err = fht_sync_time(fhz_ports, fhz_count);
+		if (err != -EAGAIN)
+			sync_pending = false;
+		if (err && err != -EAGAIN)
+			error("Unable to sync time: %s\n", strerror(-err));
+	}
+
+	/* transmit set requests that settled, after the rest of a frame */
+	for (i = 0; i < fhz_count; i++) {
+		err = fhz_transmit(&fhz_ports[i]);
+		if (!err)
+			err = fht_flush(&fhz_ports[i]);
+		if (err && err != -EAGAIN)
+			error("Error sending request: %s\n", strerror(-err));
+	}
+}
+
+/* on the serial side, as that's where devices are updated */
+static void serial_checkpoint(void)
+{
+	int err;
+
+	if (!snapshot_enabled() || !snapshot_interval ||
+	    due_in(next_snapshot))
+		return;
+
+	err = snapshot_write();
+	if (err)
+		error("Unable to write snapshot: %s\n", strerror(-err));
+	next_snapshot += snapshot_interval * 1000ULL;
+}
+
+static void trace_signal(int signal)
+{
+	trace_requested = 1;
+}
+
+static void terminate_signal(int signal)
+{
+	terminate = 1;
+}
+
+static void trace_poll(void)
+{
+	if (!trace_requested)
+		return;
+
+	trace_requested = 0;
+	trace_dump(stderr);
+}
+
+static int bridge(struct mosquitto *mosquitto)
+{
+	struct pollfd fds[FHZ_PORTS_MAX + 2], *mqtt_fd = &fds[fhz_count];
+	struct pollfd *http_fd = &fds[fhz_count + 1];
+	int err, timeout;
+
+	do {
+		if (terminate)
+			return 0;
+
+		trace_poll();
+		timeout = min_timeout(mqtt_timeout(mosquitto),
+				      serial_timeout());
+		timeout = min_timeout(timeout, metrics_timeout());
+
+		serial_poll(fds);
+		mqtt_poll(mosquitto, mqtt_fd);
+		metrics_poll(metrics_fd, http_fd);
+
+		/* wait until everything replayed reached the broker */
+		if (replay_drained() && !(mqtt_fd->events & POLLOUT) &&
+		    !mqtt_state_pending())
+			return 0;
+
+		err = poll(fds, fhz_count + 2, timeout);
+		if (err == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			error("poll: %s\n", strerror(-err));
+			return err;
+		}
+
+		metrics_serve(metrics_fd, http_fd);
+
+		err = serial_receive(fds);
+		if (err)
+			return err;
+
+		serial_handle(mosquitto, NULL);
+
+		err = mqtt_handle(mosquitto, mqtt_fd->revents);
+		if (err)
+			error("MQTT error: %s\n", strerror(-err));
+
+		serial_transmit();
+		serial_checkpoint();
+	} while(true);
+}
+
+/*
+ * Pipeline mode: a serial thread receives, decodes and transmits, the main
+ * thread publishes. They only share the ring of decoded messages and the
+ * outbound queues, so a stalled broker connection never holds up the
+ * serial ports.
+ */
+struct pipeline_threads {
+	struct pipeline pipeline;
+	/* eventfds to wake up the other side */
+	int wake_serial, wake_publisher;
+	atomic_bool stop;
+	atomic_bool done;
+	int err;
+};
+
+static void wake(int fd)
+{
+	const uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		error("Wakeup failed: %s\n", strerror(errno));
+}
+
+static void wake_ack(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count) &&
+	    errno != EAGAIN)
+		error("Wakeup failed: %s\n", strerror(errno));
+}
+
+static void *serial_thread(void *arg)
+{
+	struct pollfd fds[FHZ_PORTS_MAX + 1], *wake_fd = &fds[fhz_count];
+	struct pipeline_threads *threads = arg;
+	struct pipeline *pipeline = &threads->pipeline;
+	unsigned int head;
+	int err = 0, timeout;
+
+	/* replays end once everything was handed over to the publisher */
+	while (!replay_drained() && !atomic_load(&threads->stop)) {
+		timeout = serial_timeout();
+
+		serial_poll(fds);
+		wake_fd->fd = threads->wake_serial;
+		wake_fd->events = POLLIN;
+		wake_fd->revents = 0;
+
+		err = poll(fds, fhz_count + 1, timeout);
+		if (err == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			error("poll: %s\n", strerror(-err));
+			break;
+		}
+
+		if (wake_fd->revents & POLLIN)
+			wake_ack(threads->wake_serial);
+
+		err = serial_receive(fds);
+		if (err)
+			break;
+
+		head = atomic_load_explicit(&pipeline->head,
+					    memory_order_relaxed);
+		serial_handle(NULL, pipeline);
+		if (head != atomic_load_explicit(&pipeline->head,
+						 memory_order_relaxed))
+			wake(threads->wake_publisher);
+
+		serial_transmit();
+		serial_checkpoint();
+	}
+
+	threads->err = err;
+	atomic_store(&threads->done, true);
+	wake(threads->wake_publisher);
+
+	return NULL;
+}
+
+/* number of requests of all ports, to notice new ones */
+static unsigned int queued(void)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < fhz_count; i++) {
+		pthread_mutex_lock(&fhz_ports[i].queue.lock);
+		count += fhz_ports[i].queue.count;
+		pthread_mutex_unlock(&fhz_ports[i].queue.lock);
+	}
+
+	return count;
+}
+
+static int bridge_pipeline(struct mosquitto *mosquitto)
+{
+	static struct pipeline_threads threads = {
+		.wake_serial = -1,
+		.wake_publisher = -1,
+	};
+	unsigned long overflows, reported = 0;
+	struct fhz_message message;
+	unsigned int requests;
+	struct pollfd fds[3];
+	sigset_t signals, old;
+	pthread_t thread;
+	int err;
+
+	threads.wake_serial = eventfd(0, EFD_NONBLOCK);
+	threads.wake_publisher = eventfd(0, EFD_NONBLOCK);
+	if (threads.wake_serial == -1 || threads.wake_publisher == -1) {
+		err = -errno;
+		error("eventfd: %s\n", strerror(errno));
+		goto close_out;
+	}
+
+	/* only the publisher handles signals, the serial thread inherits the mask */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &signals, &old);
+	err = -pthread_create(&thread, NULL, serial_thread, &threads);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		error("Unable to start serial thread: %s\n", strerror(-err));
+		goto close_out;
+	}
+
+	do {
+		/* stops the serial thread below */
+		if (terminate) {
+			err = 0;
+			break;
+		}
+
+		trace_poll();
+		mqtt_poll(mosquitto, &fds[0]);
+		fds[1].fd = threads.wake_publisher;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		metrics_poll(metrics_fd, &fds[2]);
+
+		/* the serial side is gone, and everything it left reached us */
+		if (atomic_load(&threads.done) &&
+		    atomic_load(&threads.pipeline.head) ==
+		    atomic_load(&threads.pipeline.tail) &&
+		    !(fds[0].events & POLLOUT) && !mqtt_state_pending()) {
+			err = threads.err;
+			break;
+		}
+
+		err = poll(fds, ARRAY_SIZE(fds),
+			   min_timeout(mqtt_timeout(mosquitto),
+				       metrics_timeout()));
+		if (err == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			error("poll: %s\n", strerror(-err));
+			break;
+		}
+
+		if (fds[1].revents & POLLIN)
+			wake_ack(threads.wake_publisher);
+
+		metrics_serve(metrics_fd, &fds[2]);
+
+		while (pipeline_pop(&threads.pipeline, &message))
+			if (mqtt_publish(mosquitto, &message))
+				fprintf(stderr, "mqtt: unable to publish FHZ "
+					"message\n");
+
+		overflows = atomic_load(&threads.pipeline.overflows);
+		if (overflows != reported) {
+			error("Publisher fell behind, dropped %lu messages\n",
+			      overflows - reported);
+			metrics_add(metrics.ring_overflows,
+				    overflows - reported);
+			reported = overflows;
+		}
+
+		/* set requests from the broker are enqueued in here */
+		requests = queued();
+		err = mqtt_handle(mosquitto, fds[0].revents);
+		if (err)
+			error("MQTT error: %s\n", strerror(-err));
+		if (queued() > requests)
+			wake(threads.wake_serial);
+	} while (true);
+
+	atomic_store(&threads.stop, true);
+	wake(threads.wake_serial);
+	pthread_join(thread, NULL);
+
+close_out:
+	if (threads.wake_serial != -1)
+		close(threads.wake_serial);
+	if (threads.wake_publisher != -1)
+		close(threads.wake_publisher);
+	return err;
+}
 
 static void __attribute__((noreturn)) usage(int code)
 {
-	printf("Usage: fht2mqtt usb_port"
-	       "[mqtt_server] [mqtt_port] [username] [password]\n");
+	printf("Usage: fht2mqtt [-t minutes] [-H seconds] [-r capture] [-R [-F]] "
+	       "[-p] [-m port] [-S seconds] [-j ms] [-b] [-s spool] "
+	       "[-Q class:qos[:retain]] [-I inflight] [-q queued] "
+	       "[-a hauscodes | -d hauscodes] [-c snapshot [-C seconds]] "
+	       "usb_port[,usb_port...] "
+	       "[mqtt_server] [mqtt_port] [username] [password]\n"
+	       "\n"
+	       "  Up to " __stringify(FHZ_PORTS_MAX) " FHZs share one MQTT "
+	       "connection. Set requests go to the FHZ\n"
+	       "  that heard the FHT last.\n"
+	       "\n"
+	       "  -t minutes  periodically sync the clock of all FHTs seen, but\n"
+	       "              the filtered ones\n"
+	       "  -H seconds  republish unchanged state after that time "
+	       "(default: " __stringify(MQTT_DEFAULT_HEARTBEAT) ",\n"
+	       "              0: publish every report)\n"
+	       "  -r capture  record all received bytes and sent frames to the file\n"
+	       "              capture\n"
+	       "  -R          usb_port is a capture, replay it in real time\n"
+	       "  -F          replay as fast as possible\n"
+	       "  -p          receive and publish in separate threads\n"
+	       "  -m port     serve metrics on http://localhost:port/metrics\n"
+	       "  -S seconds  publish metrics to /fhz/$stats\n"
+	       "  -j ms       publish the status of a FHT as one JSON document "
+	       "to\n"
+	       "              /fhz/fht/<hauscode>/state, batching updates "
+	       "within ms\n"
+	       "  -b          additionally publish binary reports to "
+	       "/fhz/bin/fht/<hauscode>\n"
+	       "  -s spool    keep messages in the file spool while the broker "
+	       "is\n"
+	       "              unreachable\n"
+	       "  -Q class:qos[:retain]\n"
+	       "              QoS and retain flag of status, ack or set "
+	       "topics (default:\n"
+	       "              status:0:1, ack:1:0, set:1)\n"
+	       "  -I inflight QoS 1 and 2 messages in flight (default: "
+	       __stringify(MQTT_DEFAULT_INFLIGHT) ", 0: unlimited)\n"
+	       "  -q queued   drop QoS 0 messages beyond that many unsent "
+	       "ones\n"
+	       "  -a hauscodes\n"
+	       "              only handle these FHTs, e.g. 9601,1234\n"
+	       "  -d hauscodes\n"
+	       "              ignore these FHTs\n"
+	       "  -c snapshot keep the state of all FHTs in the file snapshot, "
+	       "and restore it\n"
+	       "              on startup\n"
+	       "  -C seconds  checkpoint interval of the snapshot (default: "
+	       __stringify(SNAPSHOT_DEFAULT_INTERVAL) ",\n"
+	       "              0: on exit only)\n");
 	exit(code);
 }
 
-int main(int argc, const char **argv)
+int main(int argc, char **argv)
 {
+	bool realtime = true, pipeline = false;
+	const char *record = NULL, *spool = NULL, *snapshot = NULL;
 	const char *username = NULL, *password = NULL;
 	const char *hostname = MQTT_DEFAULT_HOSTNAME;
-	unsigned int port = MQTT_DEFAULT_PORT;
+	struct mqtt_options mqtt_options = {
+		.heartbeat = MQTT_DEFAULT_HEARTBEAT,
+		/* telemetry is fire-and-forget, acks and requests are not */
+		.policy = {
+			[MQTT_CLASS_STATUS] = { .qos = 0, .retain = true },
+			[MQTT_CLASS_ACK] = { .qos = 1, .retain = false },
+			[MQTT_CLASS_SET] = { .qos = 1 },
+		},
+		.inflight = MQTT_DEFAULT_INFLIGHT,
+	};
+	unsigned int port = MQTT_DEFAULT_PORT, metrics_port = 0;
+	struct sigaction trace_action = {
+		.sa_handler = trace_signal,
+	};
+	struct sigaction terminate_action = {
+		.sa_handler = terminate_signal,
+	};
 	struct mosquitto *mosquitto;
-	struct fhz_message message;
-	int err, fd;
+	char *usb_port;
+	unsigned int i;
+	int err, opt;
+
+	while ((opt = getopt(argc, argv, "a:bc:C:d:FhH:I:j:m:pq:Q:r:RS:s:t:")) != -1) {
+		switch (opt) {
+		case 'a':
+		case 'd':
+			if (fhz_filter(optarg, opt == 'a'))
+				usage(-EINVAL);
+			break;
+		case 'b':
+			mqtt_options.binary = true;
+			break;
+		case 'c':
+			snapshot = optarg;
+			break;
+		case 'C':
+			snapshot_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'F':
+			realtime = false;
+			break;
+		case 'I':
+			mqtt_options.inflight = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			mqtt_options.state = true;
+			mqtt_options.state_window = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			metrics_port = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			pipeline = true;
+			break;
+		case 'q':
+			mqtt_options.queued = strtoul(optarg, NULL, 10);
+			break;
+		case 'Q':
+			if (mqtt_policy_parse(&mqtt_options, optarg))
+				usage(-EINVAL);
+			break;
+		case 'r':
+			record = optarg;
+			break;
+		case 'R':
+			replaying = true;
+			break;
+		case 'H':
+			mqtt_options.heartbeat = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			spool = optarg;
+			break;
+		case 'S':
+			mqtt_options.stats = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			sync_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(-EINVAL);
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 4 && argc != 2)
 		usage(-EINVAL);
@@ -52,38 +664,97 @@ int main(int argc, const char **argv)
 		password = argv[5];
 	}
 
-	fd = fhz_open_serial(argv[1]);
-	if (fd < 0)
-		return fd;
+	for (usb_port = strtok(argv[1], ","); usb_port;
+	     usb_port = strtok(NULL, ",")) {
+		if (fhz_count == FHZ_PORTS_MAX)
+			usage(-EINVAL);
+		usb_ports[fhz_count++] = usb_port;
+	}
+
+	/* a capture doesn't tell the FHZs apart */
+	if (!fhz_count || (replaying && fhz_count > 1))
+		usage(-EINVAL);
+
+	err = fht_init();
+	if (err)
+		return err;
+
+	if (record) {
+		err = capture_open(record);
+		if (err)
+			return err;
+	}
+
+	if (metrics_port) {
+		metrics_fd = metrics_listen(metrics_port);
+		if (metrics_fd < 0)
+			return metrics_fd;
+	}
+
+	if (spool) {
+		err = spool_open(spool);
+		if (err)
+			return err;
+	}
+
+	if (snapshot) {
+		err = snapshot_open(snapshot);
+		if (err)
+			return err;
+	}
 
-	err = mqtt_init(&mosquitto, fd, hostname, port, username, password);
+	if (replaying) {
+		err = replay_open(&replay, usb_ports[0], realtime);
+		if (err)
+			return err;
+		fhz_ports[0].fd = -1;
+		fht_queue_init(&fhz_ports[0].queue);
+	} else {
+		for (i = 0; i < fhz_count; i++) {
+			err = fhz_open_serial(&fhz_ports[i], usb_ports[i]);
+			if (err) {
+				fhz_count = i;
+				goto close_out;
+			}
+			fhz_ports[i].index = i;
+		}
+	}
+
+	err = mqtt_init(&mosquitto, fhz_ports, fhz_count, hostname, port,
+			username, password, &mqtt_options);
 	if (err) {
 		fprintf(stderr, "MQTT connection failure\n");
 		goto close_out;
 	}
 
-	do {
-		err = fhz_handle(fd, &message);
-		if (err && err != -EAGAIN)
-			error("Error decoding packet: %s\n", strerror(-err));
-		else if (!err) {
-			err = mqtt_publish(mosquitto, &message);
-			if (err)
-				fprintf(stderr, "mqtt: unable to publish FHZ "
-						"message\n");
-		}
+	mqtt_state_restore();
 
-		err = mqtt_handle(mosquitto);
-		if (err)
-			error("MQTT error: %s\n", strerror(-err));
+	if (sync_interval)
+		next_sync = monotonic_ms() + sync_interval * 60000ULL;
+	next_snapshot = monotonic_ms() + snapshot_interval * 1000ULL;
 
-		sleep(1);
-	} while(true);
+	/* no SA_RESTART, so that poll() returns and the histograms are dumped */
+	sigaction(SIGUSR1, &trace_action, NULL);
+	/* the same for a clean shutdown, which takes the final snapshot */
+	sigaction(SIGTERM, &terminate_action, NULL);
+	sigaction(SIGINT, &terminate_action, NULL);
 
-	err = 0;
+	if (pipeline)
+		err = bridge_pipeline(mosquitto);
+	else
+		err = bridge(mosquitto);
 
 	mqtt_close(mosquitto);
 close_out:
-	close(fd);
+	if (replaying)
+		replay_close(&replay);
+	else
+		for (i = 0; i < fhz_count; i++)
+			close(fhz_ports[i].fd);
+	if (metrics_fd != -1)
+		close(metrics_fd);
+	snapshot_close();
+	spool_close();
+	capture_close();
 	return err;
 }
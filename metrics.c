@@ -0,0 +1,380 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fhz.h"
+#include "metrics.h"
+
+#define METRICS_PATH "/metrics"
+/* enough for every tt and function id to show up */
+#define METRICS_BUFFER_SIZE (128 * 1024)
+/* ms a scraper has to send its request and take the response */
+#define METRICS_CLIENT_TIMEOUT 1000
+
+struct metrics metrics;
+
+static const unsigned int delay_buckets[] = METRICS_DELAY_BUCKETS;
+
+static const char *const decode_results[] = {
+	[METRICS_DECODE_OK] = "ok",
+	[METRICS_DECODE_PENDING] = "pending",
+	[METRICS_DECODE_ERROR] = "error",
+};
+
+struct writer {
+	char *buffer;
+	size_t size;
+	size_t length;
+};
+
+static void __attribute__((format(printf, 2, 3)))
+emit(struct writer *writer, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (writer->length >= writer->size)
+		return;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(writer->buffer + writer->length,
+			writer->size - writer->length, fmt, ap);
+	va_end(ap);
+
+	writer->length += ret;
+}
+
+#define load(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+static void emit_header(struct writer *writer, const char *name,
+			const char *type, const char *help)
+{
+	emit(writer, "# HELP fhz_%s %s\n# TYPE fhz_%s %s\n", name, help, name,
+	     type);
+}
+
+static void emit_counter(struct writer *writer, const char *name,
+			 const char *help, unsigned long value)
+{
+	emit_header(writer, name, "counter", help);
+	emit(writer, "fhz_%s %lu\n", name, value);
+}
+
+static void emit_per_tt(struct writer *writer, const char *name,
+			const char *help, atomic_ulong *counters)
+{
+	unsigned long value;
+	int tt;
+
+	emit_header(writer, name, "counter", help);
+	for (tt = 0; tt < 256; tt++) {
+		value = load(counters[tt]);
+		if (value)
+			emit(writer, "fhz_%s{tt=\"0x%02x\"} %lu\n", name, tt,
+			     value);
+	}
+}
+
+void metrics_queue_delay(unsigned long long ms)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(delay_buckets); i++)
+		if (ms <= delay_buckets[i])
+			break;
+
+	metrics_inc(metrics.queue_delay[i]);
+	metrics_add(metrics.queue_delay_sum, ms);
+}
+
+int metrics_prometheus(char *buffer, size_t size)
+{
+	struct writer writer = {buffer, size, 0};
+	unsigned long value, count = 0;
+	int i, j;
+
+	emit_per_tt(&writer, "rx_frames_total", "Frames received",
+		    metrics.rx_frames);
+	emit_per_tt(&writer, "tx_frames_total", "Frames sent",
+		    metrics.tx_frames);
+	emit_counter(&writer, "rx_checksum_errors_total",
+		     "Frames with a checksum mismatch",
+		     load(metrics.rx_checksum_errors));
+	emit_counter(&writer, "rx_magic_errors_total",
+		     "Resyncs on an invalid packet magic",
+		     load(metrics.rx_magic_errors));
+	emit_counter(&writer, "rx_timeouts_total",
+		     "Incomplete frames that timed out",
+		     load(metrics.rx_timeouts));
+	emit_counter(&writer, "rx_errors_total", "Failed reads",
+		     load(metrics.rx_errors));
+	emit_counter(&writer, "tx_errors_total", "Failed writes",
+		     load(metrics.tx_errors));
+	emit_counter(&writer, "tx_congested_total",
+		     "Writes deferred as the tty was congested",
+		     load(metrics.tx_congested));
+
+	emit_header(&writer, "decode_total", "counter",
+		    "Decoded FHT frames, by function id and result");
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < METRICS_DECODE_RESULTS; j++) {
+			value = load(metrics.decode[i][j]);
+			if (value)
+				emit(&writer, "fhz_decode_total{function="
+				     "\"0x%02x\",result=\"%s\"} %lu\n", i,
+				     decode_results[j], value);
+		}
+
+	emit_header(&writer, "filtered_total", "counter",
+		    "Frames of foreign FHTs dropped, by hauscode");
+	for (i = 0; i < ARRAY_SIZE(metrics.filtered); i++) {
+		value = load(metrics.filtered[i]);
+		if (value)
+			emit(&writer, "fhz_filtered_total{hauscode="
+			     "\"%04u\"} %lu\n", i, value);
+	}
+
+	emit_counter(&writer, "publish_errors_total",
+		     "Reports that didn't reach the broker",
+		     load(metrics.publish_errors));
+	emit_counter(&writer, "publish_dropped_total",
+		     "QoS 0 messages dropped as too many were queued",
+		     load(metrics.publish_dropped));
+	emit_counter(&writer, "reconnects_total", "Reconnects to the broker",
+		     load(metrics.reconnects));
+	emit_counter(&writer, "ring_overflows_total",
+		     "Messages dropped as the publisher fell behind",
+		     load(metrics.ring_overflows));
+	emit_counter(&writer, "spooled_total",
+		     "Messages spooled while the broker was unreachable",
+		     load(metrics.spooled));
+	emit_counter(&writer, "spool_flushed_total",
+		     "Spooled messages published after a reconnect",
+		     load(metrics.spool_flushed));
+	emit_counter(&writer, "spool_dropped_total",
+		     "Spooled messages dropped as the spool was full",
+		     load(metrics.spool_dropped));
+
+	emit_header(&writer, "queue_depth", "gauge",
+		    "Set requests waiting for transmission");
+	emit(&writer, "fhz_queue_depth %ld\n", load(metrics.queue_depth));
+
+	emit_header(&writer, "queue_delay_seconds", "histogram",
+		    "Time from enqueueing a set request to its transmission");
+	for (i = 0; i < ARRAY_SIZE(delay_buckets); i++) {
+		count += load(metrics.queue_delay[i]);
+		emit(&writer, "fhz_queue_delay_seconds_bucket{le=\"%g\"} %lu\n",
+		     delay_buckets[i] / 1000.0, count);
+	}
+	count += load(metrics.queue_delay[i]);
+	emit(&writer, "fhz_queue_delay_seconds_bucket{le=\"+Inf\"} %lu\n",
+	     count);
+	emit(&writer, "fhz_queue_delay_seconds_sum %g\n",
+	     load(metrics.queue_delay_sum) / 1000.0);
+	emit(&writer, "fhz_queue_delay_seconds_count %lu\n", count);
+
+	return writer.length < size ? writer.length : -ENOSPC;
+}
+
+/* totals only, for the stats topic */
+int metrics_json(char *buffer, size_t size)
+{
+	unsigned long rx = 0, tx = 0, decoded = 0, rejected = 0, filtered = 0;
+	int i, ret;
+
+	for (i = 0; i < 256; i++) {
+		rx += load(metrics.rx_frames[i]);
+		tx += load(metrics.tx_frames[i]);
+		decoded += load(metrics.decode[i][METRICS_DECODE_OK]);
+		rejected += load(metrics.decode[i][METRICS_DECODE_ERROR]);
+	}
+	for (i = 0; i < ARRAY_SIZE(metrics.filtered); i++)
+		filtered += load(metrics.filtered[i]);
+
+	ret = snprintf(buffer, size, "{\"rx\":%lu,\"tx\":%lu,\"checksum\":%lu,"
+		       "\"magic\":%lu,\"timeouts\":%lu,\"decoded\":%lu,"
+		       "\"rejected\":%lu,\"filtered\":%lu,\"publish_errors\":%lu,"
+		       "\"reconnects\":%lu,\"overflows\":%lu,\"queued\":%ld}",
+		       rx, tx, load(metrics.rx_checksum_errors),
+		       load(metrics.rx_magic_errors), load(metrics.rx_timeouts),
+		       decoded, rejected, filtered, load(metrics.publish_errors),
+		       load(metrics.reconnects), load(metrics.ring_overflows),
+		       load(metrics.queue_depth));
+
+	return ret < size ? ret : -ENOSPC;
+}
+
+int metrics_listen(unsigned int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd == -1) {
+		error("socket: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 4)) {
+		error("metrics port %u: %s\n", port, strerror(errno));
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+/* the scrape in progress, served as its socket becomes ready */
+static struct {
+	int fd;
+	unsigned long long deadline;
+	char request[256];
+	size_t received;
+	/* of the response, 0 while receiving the request */
+	size_t length, sent;
+} client = {
+	.fd = -1,
+};
+
+static char response[128 + METRICS_BUFFER_SIZE];
+
+static void metrics_respond(const char *status, const char *body, int length)
+{
+	int ret;
+
+	ret = snprintf(response, 128, "HTTP/1.0 %s\r\n"
+		       "Content-Type: text/plain; version=0.0.4\r\n"
+		       "Content-Length: %d\r\n\r\n", status, length);
+	memcpy(response + ret, body, length);
+	client.length = ret + length;
+	client.sent = 0;
+}
+
+static void metrics_request(void)
+{
+	static char buffer[METRICS_BUFFER_SIZE];
+	int ret;
+
+	if (strncmp(client.request, "GET " METRICS_PATH " ",
+		    sizeof("GET " METRICS_PATH " ") - 1)) {
+		metrics_respond("404 Not Found", "", 0);
+		return;
+	}
+
+	ret = metrics_prometheus(buffer, sizeof(buffer));
+	if (ret < 0)
+		metrics_respond("500 Internal Server Error", "", 0);
+	else
+		metrics_respond("200 OK", buffer, ret);
+}
+
+static void metrics_disconnect(void)
+{
+	close(client.fd);
+	client.fd = -1;
+}
+
+void metrics_poll(int fd, struct pollfd *pollfd)
+{
+	if (client.fd != -1) {
+		pollfd->fd = client.fd;
+		pollfd->events = client.length ? POLLOUT : POLLIN;
+	} else {
+		pollfd->fd = fd;
+		pollfd->events = POLLIN;
+	}
+	pollfd->revents = 0;
+}
+
+int metrics_timeout(void)
+{
+	unsigned long long now = monotonic_ms();
+
+	if (client.fd == -1)
+		return -1;
+
+	return client.deadline > now ? client.deadline - now : 0;
+}
+
+/*
+ * One request per connection and one connection at a time, scrapes are
+ * rare and small. Nothing blocks, so a stalled client can't hold up the
+ * bridge, and it is dropped after METRICS_CLIENT_TIMEOUT.
+ */
+void metrics_serve(int fd, const struct pollfd *pollfd)
+{
+	ssize_t ret;
+
+	if (client.fd == -1) {
+		if (!(pollfd->revents & POLLIN))
+			return;
+
+		client.fd = accept(fd, NULL, NULL);
+		if (client.fd == -1)
+			return;
+		fcntl(client.fd, F_SETFL, O_NONBLOCK);
+		client.deadline = monotonic_ms() + METRICS_CLIENT_TIMEOUT;
+		client.received = client.length = 0;
+	} else if (!metrics_timeout()) {
+		metrics_disconnect();
+		return;
+	}
+
+	if (!client.length) {
+		ret = read(client.fd, client.request + client.received,
+			   sizeof(client.request) - 1 - client.received);
+		if (ret == -1 && errno == EAGAIN)
+			return;
+		if (ret <= 0) {
+			metrics_disconnect();
+			return;
+		}
+		client.received += ret;
+		client.request[client.received] = 0;
+
+		/* the request line is all we need */
+		if (!strchr(client.request, '\n') &&
+		    client.received < sizeof(client.request) - 1)
+			return;
+		metrics_request();
+	}
+
+	ret = write(client.fd, response + client.sent,
+		    client.length - client.sent);
+	if (ret == -1 && errno == EAGAIN)
+		return;
+	if (ret == -1) {
+		error("metrics: %s\n", strerror(errno));
+		metrics_disconnect();
+		return;
+	}
+
+	client.sent += ret;
+	if (client.sent == client.length)
+		metrics_disconnect();
+}
@@ -0,0 +1,88 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* upper bounds of the queue delay histogram, in ms */
+#define METRICS_DELAY_BUCKETS {100, 250, 500, 1000, 2000, 3000, 5000}
+#define METRICS_DELAY_BUCKET_COUNT 7
+
+enum metrics_decode {
+	METRICS_DECODE_OK,
+	/* first half of a multi-frame value */
+	METRICS_DECODE_PENDING,
+	METRICS_DECODE_ERROR,
+	METRICS_DECODE_RESULTS,
+};
+
+/*
+ * Counters only grow. Apart from the queue depth, every counter is written
+ * by a single thread, so increments don't need to be locked.
+ */
+struct metrics {
+	atomic_ulong rx_frames[256];
+	atomic_ulong tx_frames[256];
+	atomic_ulong rx_checksum_errors;
+	atomic_ulong rx_magic_errors;
+	atomic_ulong rx_timeouts;
+	atomic_ulong rx_errors;
+	atomic_ulong tx_errors;
+	atomic_ulong tx_congested;
+	atomic_ulong decode[256][METRICS_DECODE_RESULTS];
+	/* frames of foreign FHTs, dropped before decoding */
+	atomic_ulong filtered[FHT_HAUSCODE_MAX * FHT_HAUSCODE_MAX];
+	atomic_ulong publish_errors;
+	atomic_ulong publish_dropped;
+	atomic_ulong reconnects;
+	atomic_ulong ring_overflows;
+	atomic_ulong spooled;
+	atomic_ulong spool_flushed;
+	atomic_ulong spool_dropped;
+	atomic_long queue_depth;
+	atomic_ulong queue_delay[METRICS_DELAY_BUCKET_COUNT + 1];
+	atomic_ulong queue_delay_sum;
+};
+
+extern struct metrics metrics;
+
+static inline enum metrics_decode metrics_decode_result(int err)
+{
+	if (!err)
+		return METRICS_DECODE_OK;
+	if (err == -EAGAIN)
+		return METRICS_DECODE_PENDING;
+	return METRICS_DECODE_ERROR;
+}
+
+#define metrics_add(counter, value) \
+	atomic_store_explicit(&(counter), \
+		atomic_load_explicit(&(counter), memory_order_relaxed) + \
+		(value), memory_order_relaxed)
+
+#define metrics_inc(counter) metrics_add(counter, 1)
+
+/* for counters with several writers */
+#define metrics_add_shared(counter, value) \
+	atomic_fetch_add_explicit(&(counter), (value), memory_order_relaxed)
+
+void metrics_queue_delay(unsigned long long ms);
+
+int metrics_prometheus(char *buffer, size_t size);
+int metrics_json(char *buffer, size_t size);
+
+int metrics_listen(unsigned int port);
+void metrics_poll(int fd, struct pollfd *pollfd);
+int metrics_timeout(void);
+void metrics_serve(int fd, const struct pollfd *pollfd);
@@ -10,110 +10,718 @@
  * the COPYING file in the top-level directory.
  */
 
+#include <endian.h>
 #include <errno.h>
 #include <mosquitto.h>
+#include <poll.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "mqtt.h"
 #include "fhz.h"
+#include "metrics.h"
+#include "spool.h"
+#include "trace.h"
 
 #define S_FHZ "fhz/"
 #define S_FHT "fht/"
 #define S_SET "set/"
+#define S_BIN "bin/"
 
 #define TOPIC "/" S_FHZ
 #define TOPIC_SUBSCRIBE TOPIC S_SET
 #define TOPIC_FHT TOPIC S_FHT
+#define TOPIC_SET_FHT TOPIC_SUBSCRIBE S_FHT
+#define TOPIC_STATS TOPIC "$stats"
+#define TOPIC_BIN_FHT TOPIC S_BIN S_FHT
+
+/* interval for keepalive and reconnect handling, in ms */
+#define MQTT_MISC_INTERVAL 1000
+/* spooled messages published per mqtt_handle() */
+#define MQTT_SPOOL_BATCH 64
+#define MQTT_KEEPALIVE 120
+/* reconnect backoff, doubled on every failure, in ms */
+#define MQTT_BACKOFF_MIN 500
+#define MQTT_BACKOFF_MAX 60000
+
+/*
+ * Topics and the last published values of a device, allocated when it
+ * reports first. Indexed by hauscode, so it never runs out of room, and
+ * topics are formatted once.
+ */
+struct mqtt_report {
+	char topic[48];
+	char value[16];
+	unsigned long long stamp;
+};
+
+struct mqtt_device {
+	struct mqtt_report report[2][FHT_SLOTS];
+	char bin_topic[24];
+	char state_topic[32];
+	char stale_topic[32];
+	/* stale fields as last published to the stale topic */
+	unsigned int stale;
+};
+
+static const char *const mqtt_types[] = {
+	[STATUS] = "status",
+	[ACK] = "ack",
+};
+
+static const char *const mqtt_classes[] = {
+	[MQTT_CLASS_STATUS] = "status",
+	[MQTT_CLASS_ACK] = "ack",
+	[MQTT_CLASS_SET] = "set",
+};
+
+static const struct mqtt_policy stats_policy = {
+	.qos = 0,
+	.retain = false,
+};
+
+static struct mqtt_device *mqtt_devices[FHT_HAUSCODE_MAX][FHT_HAUSCODE_MAX];
+
+/* aggregated state per hauscode, see mqtt_publish_states() */
+struct mqtt_state {
+	bool pending;
+	/* of the last published document */
+	unsigned int hash;
+	unsigned long long stamp;
+};
+
+static struct mqtt_state mqtt_states[FHT_HAUSCODE_MAX][FHT_HAUSCODE_MAX];
+
+/*
+ * Hauscodes with pending state, ordered by due time as the window is
+ * constant. A hauscode is queued at most once, so this never overflows.
+ * Indices wrap at the size, one slot stays free.
+ */
+#define MQTT_STATE_QUEUE_SIZE (FHT_HAUSCODE_MAX * FHT_HAUSCODE_MAX + 1)
+
+static struct {
+	struct hauscode hauscode;
+	unsigned long long due;
+} state_queue[MQTT_STATE_QUEUE_SIZE];
+static unsigned int state_head, state_tail;
+
+static struct mqtt_options options;
+/* set requests are routed to one of the FHZs */
+static unsigned int port_count;
+static unsigned long long last_misc;
+/* handed to mosquitto, but not yet written or acknowledged */
+static unsigned int outstanding;
+
+/*
+ * Apart from resolving the hostname, connects never block: the socket is
+ * connected in the background, and the broker confirms the session in
+ * connect_callback(). Until then, messages go to the spool.
+ */
+static enum {
+	MQTT_DISCONNECTED,
+	MQTT_CONNECTING,
+	MQTT_CONNECTED,
+} connection;
+static const char *broker_host;
+static int broker_port;
+static unsigned int backoff;
+static unsigned long long next_connect;
+static unsigned int seed;
+static unsigned long long last_stats;
 
 static int mqtt_subscribe(struct mosquitto *mosquitto)
 {
-	return mosquitto_subscribe(mosquitto, NULL, TOPIC_SUBSCRIBE "#", 0);
+	return mosquitto_subscribe(mosquitto, NULL, TOPIC_SUBSCRIBE "#",
+				   options.policy[MQTT_CLASS_SET].qos);
 }
 
-static int mqtt_receive_fht(int fd, const char *topic, const char *payload)
+/*
+ * Route /fhz/set/fht/<hauscode>/<command> in a single pass over the topic,
+ * without copying it. Anything that doesn't match is rejected before the
+ * payload is looked at.
+ */
+static int mqtt_route_fht(const char *topic, struct hauscode *hauscode,
+			  const struct fht_command **command)
 {
-	struct hauscode hauscode;
-	char buffer[5];
-
-	if (strlen(topic) < 6)
+	if (strncmp(topic, TOPIC_SET_FHT, sizeof(TOPIC_SET_FHT) - 1))
 		return -EINVAL;
+	topic += sizeof(TOPIC_SET_FHT) - 1;
 
-	memcpy(buffer, topic, 4);
-	buffer[4] = 0;
-	if (hauscode_from_string(buffer, &hauscode))
+	if (hauscode_parse(topic, hauscode) || topic[4] != '/')
 		return -EINVAL;
+	topic += 5;
 
-	if (topic[4] != '/')
+	*command = fht_command_lookup(topic);
+	if (!*command)
 		return -EINVAL;
 
-	topic += 5;
-
-	return fht_set(fd, &hauscode, topic, payload);
+	return 0;
 }
 
-static void callback(struct mosquitto *mosquitto, void *v_fd,
+static void callback(struct mosquitto *mosquitto, void *v_ports,
 		     const struct mosquitto_message *message)
 {
-	const char *topic = message->topic + sizeof(TOPIC_SUBSCRIBE) - 1;
+	const struct fht_command *command;
+	struct fhz_port *port;
+	struct hauscode hauscode;
 	char buffer[128];
-	const int fd = (int)(size_t)v_fd;
 	int err;
 
-	if (message->payloadlen > 127)
-		return;
+	err = mqtt_route_fht(message->topic, &hauscode, &command);
+	if (err)
+		goto out;
 
+	if (message->payloadlen > sizeof(buffer) - 1) {
+		err = -EMSGSIZE;
+		goto out;
+	}
+
+	/* converters expect a string, the payload isn't terminated */
 	memcpy(buffer, message->payload, message->payloadlen);
 	buffer[message->payloadlen] = 0;
 
-	if (!strncmp(topic, S_FHT, sizeof(S_FHT) - 1)) {
-		err = mqtt_receive_fht(fd, topic + sizeof(S_FHT) - 1, buffer);
-	} else {
-		err = -EINVAL;
-	}
+	port = fhz_route(v_ports, port_count, &hauscode);
+	err = fht_set(&port->queue, &hauscode, command, buffer);
 
+out:
 	if (err)
 		printf("Unable to parse request: %s\n", strerror(-err));
 }
 
-static inline void publish(struct mosquitto *mosquitto, const char *type,
-		           const struct hauscode *hauscode, const char *topic,
-		           const char *value)
+static struct mqtt_device *mqtt_device(const struct hauscode *hauscode)
+{
+	struct mqtt_device *device;
+	const char *topic;
+	int type, slot;
+
+	if (!hauscode_valid(hauscode))
+		return NULL;
+
+	device = mqtt_devices[hauscode->upper][hauscode->lower];
+	if (device)
+		return device;
+
+	device = calloc(1, sizeof(*device));
+	if (!device)
+		return NULL;
+
+	for (type = 0; type < ARRAY_SIZE(mqtt_types); type++)
+		for (slot = 0; slot < FHT_SLOTS; slot++) {
+			topic = fht_slot_topic(slot);
+			if (topic)
+				snprintf(device->report[type][slot].topic,
+					 sizeof(device->report[type][slot].topic),
+					 TOPIC_FHT "%02u%02u/%s/%s",
+					 hauscode->upper, hauscode->lower,
+					 mqtt_types[type], topic);
+		}
+	snprintf(device->bin_topic, sizeof(device->bin_topic),
+		 TOPIC_BIN_FHT "%02u%02u", hauscode->upper, hauscode->lower);
+	snprintf(device->state_topic, sizeof(device->state_topic),
+		 TOPIC_FHT "%02u%02u/state", hauscode->upper, hauscode->lower);
+	snprintf(device->stale_topic, sizeof(device->stale_topic),
+		 TOPIC_FHT "%02u%02u/stale", hauscode->upper, hauscode->lower);
+
+	mqtt_devices[hauscode->upper][hauscode->lower] = device;
+	return device;
+}
+
+static int mqtt_errno(int err)
+{
+	switch (err) {
+	case MOSQ_ERR_SUCCESS:
+		return 0;
+	case MOSQ_ERR_NO_CONN:
+	case MOSQ_ERR_CONN_LOST:
+		return -ENOTCONN;
+	case MOSQ_ERR_NOMEM:
+		return -ENOMEM;
+	case MOSQ_ERR_ERRNO:
+		return -errno;
+	default:
+		return -EIO;
+	}
+}
+
+/* QoS 0 messages are refused until the broker took some of the queue */
+static inline bool mqtt_congested(void)
+{
+	return options.queued && outstanding >= options.queued;
+}
+
+/* the broker can't take it right now, but the spool can */
+static inline bool mqtt_spoolable(int err)
+{
+	return spool_enabled() && (err == -ENOTCONN || err == -ENOBUFS);
+}
+
+/*
+ * Fire-and-forget messages are dropped rather than queued without bound
+ * while the broker lags behind. Reliable ones are always queued.
+ */
+static int send_message(struct mosquitto *mosquitto, const char *topic,
+			const void *payload, int length,
+			const struct mqtt_policy *policy)
+{
+#ifndef NO_SEND
+	int err;
+
+	if (!policy->qos && mqtt_congested())
+		return -ENOBUFS;
+
+	/* the publish callback may already fire from within */
+	outstanding++;
+	err = mosquitto_publish(mosquitto, NULL, topic, length, payload,
+				policy->qos, policy->retain);
+	if (err) {
+		outstanding--;
+		return mqtt_errno(err);
+	}
+#endif
+
+	return 0;
+}
+
+/* nothing overtakes what is already spooled */
+static inline bool mqtt_spooling(void)
+{
+	return spool_enabled() &&
+	       (connection != MQTT_CONNECTED || !spool_empty());
+}
+
+static int mqtt_spool(const char *topic, const void *payload, int length,
+		      const struct mqtt_policy *policy)
+{
+	struct spool_message message;
+
+	if (strlen(topic) >= sizeof(message.topic) ||
+	    length > sizeof(message.payload))
+		return -EMSGSIZE;
+
+	memset(&message, 0, sizeof(message));
+	strcpy(message.topic, topic);
+	message.length = length;
+	message.qos = policy->qos;
+	message.retain = policy->retain;
+	memcpy(message.payload, payload, length);
+
+	return spool_push(&message);
+}
+
+/*
+ * Messages are rendered once. What the broker can't take right now goes to
+ * the spool as is, and is published verbatim once the broker is back.
+ */
+static int emit(struct mosquitto *mosquitto, const char *topic,
+		const void *payload, int length,
+		const struct mqtt_policy *policy)
 {
-	char mqtt_topic[64];
+	int err;
+
+	if (mqtt_spooling())
+		return mqtt_spool(topic, payload, length, policy);
 
-	snprintf(mqtt_topic, sizeof(mqtt_topic), TOPIC_FHT "%02u%02u/%s/%s",
-		 hauscode->upper, hauscode->lower, type, topic);
+	err = send_message(mosquitto, topic, payload, length, policy);
+	if (mqtt_spoolable(err))
+		return mqtt_spool(topic, payload, length, policy);
 
+	return err;
+}
+
+static inline int publish(struct mosquitto *mosquitto, const char *topic,
+			  const char *value, int length,
+			  const struct mqtt_policy *policy)
+{
 #ifdef DEBUG
-	printf("%s %s\n", mqtt_topic, value);
+	printf("%s %s\n", topic, value);
 #endif
-#ifndef NO_SEND
-	mosquitto_publish(mosquitto, NULL, mqtt_topic, strlen(value), value, 0,
-			  false);
+	return emit(mosquitto, topic, value, length, policy);
+}
+
+static void publish_callback(struct mosquitto *mosquitto, void *v_ports,
+			     int mid)
+{
+	if (outstanding)
+		outstanding--;
+}
+
+/*
+ * Binary report for high-rate consumers, on /fhz/bin/fht/<hauscode>. All
+ * fields are in network byte order:
+ *
+ *   u8 type (0: status, 1: ack), u8 register, u8 status, u8 raw value,
+ *   s8 exponent, s32 value, u64 wall clock of reception in ms
+ *
+ * where the value of the report is value * 10^exponent.
+ */
+#define MQTT_BINARY_SIZE 17
+
+static int mqtt_publish_binary(struct mosquitto *mosquitto,
+			       const struct fht_message *message)
+{
+	/* a stream of events, nothing to retain */
+	const struct mqtt_policy policy = {
+		.qos = options.policy[message->type == STATUS ?
+				      MQTT_CLASS_STATUS : MQTT_CLASS_ACK].qos,
+	};
+	const struct mqtt_device *device = mqtt_device(&message->hauscode);
+	unsigned char buffer[MQTT_BINARY_SIZE];
+	uint32_t fixed = htobe32(message->raw.fixed);
+	uint64_t time = htobe64(message->raw.time);
+
+	if (!device)
+		return -ENOMEM;
+
+	buffer[0] = message->type;
+	buffer[1] = message->raw.cmd;
+	buffer[2] = message->raw.status;
+	buffer[3] = message->raw.value;
+	buffer[4] = message->raw.exponent;
+	memcpy(buffer + 5, &fixed, sizeof(fixed));
+	memcpy(buffer + 9, &time, sizeof(time));
+
+#ifdef DEBUG
+	printf("%s %02x: %de%d\n", device->bin_topic, message->raw.cmd,
+	       message->raw.fixed, message->raw.exponent);
 #endif
+	return emit(mosquitto, device->bin_topic, buffer, sizeof(buffer),
+		    &policy);
+}
+
+/*
+ * State is published according to the status policy, unless it didn't
+ * change since the last time and the heartbeat interval didn't elapse yet.
+ * Acks are always forwarded. Returns 1 if the report was handed to the
+ * broker, 0 if it was suppressed.
+ */
+static int mqtt_publish_report(struct mosquitto *mosquitto,
+			       const struct fht_message *message, int no)
+{
+	const int slot = fht_report_slot(message, no);
+	const char *value = message->report[no].value;
+	unsigned long long now = monotonic_ms();
+	const bool state = message->type == STATUS;
+	struct mqtt_device *device;
+	struct mqtt_report *report;
+	int err;
+
+	if (slot < 0)
+		return -EINVAL;
+
+	device = mqtt_device(&message->hauscode);
+	if (!device)
+		return -ENOMEM;
+	report = &device->report[message->type][slot];
+
+	if (state && options.heartbeat && report->stamp &&
+	    !strcmp(report->value, value) &&
+	    now - report->stamp < options.heartbeat * 1000ULL)
+		return 0;
+
+	err = publish(mosquitto, report->topic, value,
+		      message->report[no].length,
+		      &options.policy[state ? MQTT_CLASS_STATUS :
+				      MQTT_CLASS_ACK]);
+	if (err)
+		return err;
+
+	/* only remember what actually reached the broker */
+	if (state) {
+		memcpy(report->value, value, message->report[no].length);
+		report->value[message->report[no].length] = 0;
+		report->stamp = now;
+	}
+
+	return 1;
+}
+
+static void mqtt_state_queue(const struct hauscode *hauscode,
+			     unsigned long long due)
+{
+	struct mqtt_state *state =
+		&mqtt_states[hauscode->upper][hauscode->lower];
+
+	if (state->pending)
+		return;
+
+	state->pending = true;
+	state_queue[state_head].hauscode = *hauscode;
+	state_queue[state_head].due = due;
+	state_head = (state_head + 1) % MQTT_STATE_QUEUE_SIZE;
+}
+
+/* the state is published once the window of its first update elapsed */
+static void mqtt_state_update(const struct hauscode *hauscode)
+{
+	mqtt_state_queue(hauscode, monotonic_ms() + options.state_window);
+}
+
+/*
+ * Restored state goes out as soon as the broker is connected: as document
+ * with -j, on the report topics otherwise. Nothing was queued before, so the
+ * queue stays in order.
+ */
+void mqtt_state_restore(void)
+{
+	struct fht_device device;
+	struct hauscode hauscode;
+	unsigned long long now;
+
+	now = monotonic_ms();
+	for (hauscode.upper = 0; hauscode.upper < FHT_HAUSCODE_MAX;
+	     hauscode.upper++)
+		for (hauscode.lower = 0; hauscode.lower < FHT_HAUSCODE_MAX;
+		     hauscode.lower++) {
+			fht_device_read(&hauscode, &device);
+			if (device.stale)
+				mqtt_state_queue(&hauscode, now);
+		}
+}
+
+static unsigned int mqtt_hash(const char *data, int length)
+{
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < length; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 16777619;
+
+	return hash;
+}
+
+/*
+ * The report topics of the stale fields, comma separated, on
+ * /fhz/fht/<hauscode>/stale. Published with the status policy whenever the
+ * set changes, and empty once the FHT confirmed everything.
+ */
+static int mqtt_publish_stale(struct mosquitto *mosquitto,
+			      const struct fht_device *state,
+			      const struct hauscode *hauscode)
+{
+	struct mqtt_device *device = mqtt_device(hauscode);
+	struct fht_message message;
+	size_t length = 0;
+	const char *topic;
+	char buffer[256] = "";
+	int field, i, err;
+
+	if (!device)
+		return -ENOMEM;
+	if (device->stale == state->stale)
+		return 0;
+
+	for (field = 0; field < FHT_FIELDS; field++) {
+		if (!(state->stale & (1 << field)) ||
+		    fht_field_message(state, hauscode, field, &message))
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(message.report); i++) {
+			topic = fht_report_topic(&message, i);
+			if (!message.report[i].topic || !topic)
+				continue;
+			length += snprintf(buffer + length,
+					   sizeof(buffer) - length, "%s%s",
+					   length ? "," : "", topic);
+			if (length >= sizeof(buffer))
+				return -ENOSPC;
+		}
+	}
+
+	err = publish(mosquitto, device->stale_topic, buffer, length,
+		      &options.policy[MQTT_CLASS_STATUS]);
+	if (err)
+		return err;
+
+	device->stale = state->stale;
+	return 0;
+}
+
+/*
+ * Without -j, restored fields are published like the status reports of the
+ * FHT, so they are retained on the same topics, and marked as stale.
+ */
+static int mqtt_publish_restored(struct mosquitto *mosquitto,
+				 const struct hauscode *hauscode)
+{
+	struct fht_message message;
+	struct fht_device device;
+	int field, i, err;
+
+	err = fht_device_read(hauscode, &device);
+	if (err)
+		return err;
+
+	for (field = 0; field < FHT_FIELDS; field++) {
+		if (!(device.stale & (1 << field)) ||
+		    fht_field_message(&device, hauscode, field, &message))
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(message.report); i++) {
+			if (!message.report[i].topic)
+				continue;
+			err = mqtt_publish_report(mosquitto, &message, i);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	return mqtt_publish_stale(mosquitto, &device, hauscode);
+}
+
+/* the FHT confirmed fields, the stale marker follows */
+static void mqtt_refresh_stale(struct mosquitto *mosquitto,
+			       const struct hauscode *hauscode)
+{
+	const struct mqtt_device *device = mqtt_device(hauscode);
+	struct fht_device state;
+
+	if (!device || !device->stale || fht_device_read(hauscode, &state))
+		return;
 
+	if (mqtt_publish_stale(mosquitto, &state, hauscode))
+		metrics_inc(metrics.publish_errors);
 }
 
+/* like reports, unchanged state is suppressed until the heartbeat elapsed */
+static int mqtt_publish_state(struct mosquitto *mosquitto,
+			      const struct hauscode *hauscode)
+{
+	struct mqtt_state *state =
+		&mqtt_states[hauscode->upper][hauscode->lower];
+	unsigned long long now = monotonic_ms();
+	struct mqtt_device *device;
+	/* whatever is published might have to be spooled */
+	char buffer[SPOOL_PAYLOAD_MAX];
+	unsigned int hash;
+	int length, err;
+
+	length = fht_state_json(hauscode, buffer, sizeof(buffer));
+	if (length < 0)
+		return length;
+
+	hash = mqtt_hash(buffer, length);
+	if (options.heartbeat && state->stamp && state->hash == hash &&
+	    now - state->stamp < options.heartbeat * 1000ULL)
+		return 0;
+
+	device = mqtt_device(hauscode);
+	if (!device)
+		return -ENOMEM;
+
+	err = publish(mosquitto, device->state_topic, buffer, length,
+		      &options.policy[MQTT_CLASS_STATUS]);
+	if (err)
+		return err;
+
+	state->hash = hash;
+	state->stamp = now;
+	return 0;
+}
+
+static void mqtt_publish_states(struct mosquitto *mosquitto)
+{
+	unsigned long long now = monotonic_ms();
+	const struct hauscode *hauscode;
+	int err;
+
+	while (state_tail != state_head && state_queue[state_tail].due <= now) {
+		hauscode = &state_queue[state_tail].hauscode;
+		state_tail = (state_tail + 1) % MQTT_STATE_QUEUE_SIZE;
+		mqtt_states[hauscode->upper][hauscode->lower].pending = false;
+
+		/* without -j, only restored state is queued */
+		if (options.state)
+			err = mqtt_publish_state(mosquitto, hauscode);
+		else
+			err = mqtt_publish_restored(mosquitto, hauscode);
+		if (err == -ENOBUFS) {
+			/* try again later, the state is still there */
+			metrics_inc(metrics.publish_dropped);
+			mqtt_state_update(hauscode);
+			break;
+		} else if (err) {
+			metrics_inc(metrics.publish_errors);
+		}
+	}
+}
+
+bool mqtt_state_pending(void)
+{
+	return state_tail != state_head;
+}
+
+bool mqtt_connected(void)
+{
+	return connection == MQTT_CONNECTED;
+}
+
+/* messages the broker didn't take yet, written or acknowledged */
+unsigned int mqtt_outstanding(void)
+{
+	return outstanding;
+}
+
+static int mqtt_publish_error(int ret, int err)
+{
+	if (err == -ENOBUFS)
+		metrics_inc(metrics.publish_dropped);
+	else
+		metrics_inc(metrics.publish_errors);
+
+	return ret ? ret : err;
+}
+
+/* Returns the number of reports handed to the broker or the spool. */
 static int mqtt_publish_fht(struct mosquitto *mosquitto,
 			    const struct fht_message *message)
 {
-	const char *type;
-	int i;
+	int i, err, ret = 0, published = 0;
 
-	type = message->type == ACK ? "ack" : "status";
+	if (options.binary && message->raw.scaled) {
+		err = mqtt_publish_binary(mosquitto, message);
+		if (err)
+			ret = mqtt_publish_error(ret, err);
+		else
+			published++;
+	}
+
+	/* status reports only go into the state, acks are still forwarded */
+	if (options.state && message->state) {
+		/* while spooling, the state of this very moment is kept */
+		if (mqtt_spooling()) {
+			err = mqtt_publish_state(mosquitto, &message->hauscode);
+			if (err)
+				ret = mqtt_publish_error(ret, err);
+		} else {
+			mqtt_state_update(&message->hauscode);
+		}
+		if (message->type == STATUS)
+			return ret ? ret : published;
+	}
 
 	for (i = 0; i < ARRAY_SIZE(message->report); i++) {
-		if (!message->report[i].topic[0])
+		if (!message->report[i].topic)
 			continue;
-		publish(mosquitto, type, &message->hauscode,
-			message->report[i].topic, message->report[i].value);
+
+		err = mqtt_publish_report(mosquitto, message, i);
+		if (err < 0)
+			ret = mqtt_publish_error(ret, err);
+		else
+			published += err;
 	}
 
-	return 0;
+	if (message->state)
+		mqtt_refresh_stale(mosquitto, &message->hauscode);
+
+	return ret ? ret : published;
 }
 
-int mqtt_publish(struct mosquitto *mosquitto, const struct fhz_message *message)
+static int mqtt_publish_message(struct mosquitto *mosquitto,
+				const struct fhz_message *message)
 {
 	switch (message->machine) {
 	case FHT:
@@ -123,45 +731,220 @@ int mqtt_publish(struct mosquitto *mosquitto, const struct fhz_message *message)
 	}
 }
 
-int mqtt_handle(struct mosquitto *mosquitto)
+int mqtt_publish(struct mosquitto *mosquitto, const struct fhz_message *message)
 {
-	int err;
+	const bool spooled = mqtt_spooling();
+	unsigned long long now;
+	int ret;
+
+	ret = mqtt_publish_message(mosquitto, message);
+	if (ret < 0)
+		return ret;
+	/* only what went out right away is traced */
+	if (!ret || spooled)
+		return 0;
+
+	now = monotonic_ns();
+	trace_record(TRACE_RX_PUBLISH, now - message->stamp.decoded);
+	trace_record(TRACE_RX_TOTAL, now - message->stamp.available);
+
+	return 0;
+}
+
+void mqtt_poll(struct mosquitto *mosquitto, struct pollfd *pollfd)
+{
+	/* a negative fd is ignored by poll(), e.g., while disconnected */
+	pollfd->fd = mosquitto_socket(mosquitto);
+	pollfd->events = POLLIN;
+	if (mosquitto_want_write(mosquitto))
+		pollfd->events |= POLLOUT;
+	pollfd->revents = 0;
+}
+
+/* publish spooled messages in order, verbatim */
+static void mqtt_flush_spool(struct mosquitto *mosquitto)
+{
+	struct spool_message message;
+	struct mqtt_policy policy;
+	int i, err;
+
+	for (i = 0; i < MQTT_SPOOL_BATCH; i++) {
+		if (spool_peek(&message))
+			break;
+
+		policy.qos = message.qos;
+		policy.retain = message.retain;
+		err = send_message(mosquitto, message.topic, message.payload,
+				   message.length, &policy);
+		/* stays in the spool until the broker is able to take it */
+		if (err == -ENOTCONN || err == -ENOBUFS)
+			break;
+
+		/* anything else won't get better by retrying */
+		spool_pop();
+	}
+}
+
+int mqtt_timeout(struct mosquitto *mosquitto)
+{
+	unsigned long long now = monotonic_ms(), due;
+
+	if (connection == MQTT_DISCONNECTED)
+		return next_connect > now ? next_connect - now : 0;
 
-	err = mosquitto_loop(mosquitto, 0, 1);
-	if (err == MOSQ_ERR_CONN_LOST || err == MOSQ_ERR_NO_CONN) {
-		err = mosquitto_reconnect(mosquitto);
-		if (!err)
-			err = mqtt_subscribe(mosquitto);
+	/* when congested, the publish callbacks wake us up */
+	if (connection == MQTT_CONNECTED && !spool_empty() && !mqtt_congested())
+		return 0;
+
+	due = last_misc + MQTT_MISC_INTERVAL;
+	if (connection == MQTT_CONNECTED && state_tail != state_head &&
+	    !mqtt_congested() && state_queue[state_tail].due < due)
+		due = state_queue[state_tail].due;
+
+	if (due <= now)
+		return 0;
+
+	return due - now;
+}
+
+/* exponential backoff, jittered so that clients don't retry in lockstep */
+static void mqtt_backoff(void)
+{
+	unsigned int delay;
+
+	backoff = backoff ? backoff * 2 : MQTT_BACKOFF_MIN;
+	if (backoff > MQTT_BACKOFF_MAX)
+		backoff = MQTT_BACKOFF_MAX;
+
+	/* between half and the full backoff */
+	delay = backoff / 2 + rand_r(&seed) % (backoff / 2 + 1);
+	next_connect = monotonic_ms() + delay;
+	connection = MQTT_DISCONNECTED;
+
+	fprintf(stderr, "mqtt: broker unreachable, retrying in %u ms\n", delay);
+}
+
+static void mqtt_connect(struct mosquitto *mosquitto)
+{
+	/* the callback may already fire from within */
+	connection = MQTT_CONNECTING;
+	last_misc = monotonic_ms();
+	if (mosquitto_connect_async(mosquitto, broker_host, broker_port,
+				    MQTT_KEEPALIVE))
+		mqtt_backoff();
+}
+
+static void connect_callback(struct mosquitto *mosquitto, void *v_ports,
+			     int result)
+{
+	if (result) {
+		fprintf(stderr, "mqtt: connection refused (%d)\n", result);
+		return;
+	}
+
+	connection = MQTT_CONNECTED;
+	backoff = 0;
+	/* what was queued for the old connection is resent or gone */
+	outstanding = 0;
+
+	/* a clean session forgets subscriptions */
+	if (mqtt_subscribe(mosquitto))
+		fprintf(stderr, "mosquitto subscription error\n");
+}
+
+static void mqtt_publish_stats(struct mosquitto *mosquitto)
+{
+	char buffer[512];
+	int length;
+
+	length = metrics_json(buffer, sizeof(buffer));
+	if (length < 0)
+		return;
+
+	/* a snapshot of the moment, not worth spooling */
+	if (send_message(mosquitto, TOPIC_STATS, buffer, length, &stats_policy))
+		metrics_inc(metrics.publish_errors);
+}
+
+/*
+ * Returns an error once, when the connection is lost. Reconnects happen in
+ * here as well, once the backoff elapsed.
+ */
+int mqtt_handle(struct mosquitto *mosquitto, short revents)
+{
+	int err = MOSQ_ERR_SUCCESS;
+
+	if (connection == MQTT_DISCONNECTED) {
+		if (monotonic_ms() >= next_connect) {
+			metrics_inc(metrics.reconnects);
+			mqtt_connect(mosquitto);
+		}
+		return 0;
+	}
+
+	if (revents & (POLLIN | POLLERR | POLLHUP))
+		err = mosquitto_loop_read(mosquitto, 1);
+	if (!err && (revents & POLLOUT))
+		err = mosquitto_loop_write(mosquitto, 1);
+	if (!err && monotonic_ms() - last_misc >= MQTT_MISC_INTERVAL) {
+		last_misc = monotonic_ms();
+		err = mosquitto_loop_misc(mosquitto);
+
+		if (!err && connection == MQTT_CONNECTED && options.stats &&
+		    last_misc - last_stats >= options.stats * 1000ULL) {
+			last_stats = last_misc;
+			mqtt_publish_stats(mosquitto);
+		}
+	}
+
+	if (!err && connection == MQTT_CONNECTED) {
+		mqtt_publish_states(mosquitto);
+		mqtt_flush_spool(mosquitto);
 	}
+
 	switch (err) {
 	case MOSQ_ERR_SUCCESS:
-		break;
+		return 0;
 	case MOSQ_ERR_CONN_LOST:
-		return -ECONNABORTED;
+		err = -ECONNABORTED;
+		break;
 	case MOSQ_ERR_NO_CONN:
-		return -ECANCELED;
+		err = -ECANCELED;
+		break;
 	case MOSQ_ERR_ERRNO:
-		return -errno;
+		err = -errno;
+		break;
 	default:
-		return -EINVAL;
+		err = -EINVAL;
+		break;
 	}
 
-	return 0;
+	/* the socket is gone, or the broker refused the session */
+	mqtt_backoff();
+	return err;
 }
 
-int mqtt_init(struct mosquitto **handle, int fd, const char *host, int port,
-	      const char *username, const char *password)
+int mqtt_init(struct mosquitto **handle, struct fhz_port *fhz_ports,
+	      unsigned int fhz_count, const char *host, int port,
+	      const char *username, const char *password,
+	      const struct mqtt_options *mqtt_options)
 {
 	struct mosquitto *mosquitto;
 	int err;
 
-	if (!host || !port)
+	if (!host || !port || !fhz_count)
 		return -EINVAL;
 
+	options = *mqtt_options;
+	port_count = fhz_count;
+	broker_host = host;
+	broker_port = port;
+	seed = getpid() ^ monotonic_ms();
+
 	if (mosquitto_lib_init() != MOSQ_ERR_SUCCESS)
 		return -EINVAL;
 
-	mosquitto = mosquitto_new(NULL, true, (void*)(size_t)fd);
+	mosquitto = mosquitto_new(NULL, true, fhz_ports);
 	if (!mosquitto)
 		return -errno;
 
@@ -171,18 +954,17 @@ int mqtt_init(struct mosquitto **handle, int fd, const char *host, int port,
 			goto close_out;
 	}
 
-	err = mosquitto_connect(mosquitto, host, port, 120);
-	if (err) {
-		fprintf(stderr, "mosquitto connect error\n");
+	/* 0 lifts the limit */
+	err = mosquitto_max_inflight_messages_set(mosquitto, options.inflight);
+	if (err)
 		goto close_out;
-	}
-
-	err = mqtt_subscribe(mosquitto);
-	if (err) {
-		fprintf(stderr, "mosquitto subscription error\n");
-	}
 
+	mosquitto_connect_callback_set(mosquitto, connect_callback);
 	mosquitto_message_callback_set(mosquitto, callback);
+	mosquitto_publish_callback_set(mosquitto, publish_callback);
+
+	/* if the broker isn't up yet, we'll retry in the background */
+	mqtt_connect(mosquitto);
 
 	*handle = mosquitto;
 	return 0;
@@ -193,6 +975,45 @@ close_out:
 	return -1;
 }
 
+/* class:qos[:retain], e.g. ack:1 or status:0:1 */
+int mqtt_policy_parse(struct mqtt_options *mqtt_options, const char *arg)
+{
+	struct mqtt_policy policy;
+	unsigned long retain;
+	const char *sep;
+	char *end;
+	int i;
+
+	sep = strchr(arg, ':');
+	if (!sep)
+		return -EINVAL;
+
+	for (i = 0; i < MQTT_CLASSES; i++)
+		if (strlen(mqtt_classes[i]) == sep - arg &&
+		    !strncmp(arg, mqtt_classes[i], sep - arg))
+			break;
+	if (i == MQTT_CLASSES)
+		return -EINVAL;
+
+	policy = mqtt_options->policy[i];
+	policy.qos = strtoul(sep + 1, &end, 10);
+	if (end == sep + 1 || policy.qos > 2)
+		return -EINVAL;
+
+	if (*end == ':') {
+		sep = end + 1;
+		retain = strtoul(sep, &end, 10);
+		if (end == sep || retain > 1)
+			return -EINVAL;
+		policy.retain = retain;
+	}
+	if (*end)
+		return -EINVAL;
+
+	mqtt_options->policy[i] = policy;
+	return 0;
+}
+
 void mqtt_close(struct mosquitto *mosquitto)
 {
 	mosquitto_destroy(mosquitto);
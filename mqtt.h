@@ -11,12 +11,56 @@
  */
 
 struct fhz_message;
+struct fhz_port;
 struct mosquitto;
+struct pollfd;
 
-int mqtt_init(struct mosquitto **handle, int fd, const char *host, int port,
-	      const char *username, const char *password);
+/* topic classes with their own QoS and retain policy */
+enum mqtt_class {
+	/* status reports, states and binary status reports */
+	MQTT_CLASS_STATUS,
+	MQTT_CLASS_ACK,
+	/* the subscription to set requests, retain doesn't apply */
+	MQTT_CLASS_SET,
+	MQTT_CLASSES,
+};
+
+struct mqtt_policy {
+	unsigned int qos;
+	bool retain;
+};
+
+struct mqtt_options {
+	/* republish unchanged state after that many seconds, 0: always */
+	unsigned int heartbeat;
+	/* publish metrics every that many seconds, 0: never */
+	unsigned int stats;
+	/* publish status as one JSON document per FHT... */
+	bool state;
+	/* ...batching updates within that many ms */
+	unsigned int state_window;
+	/* additionally publish binary reports to /fhz/bin/ */
+	bool binary;
+	struct mqtt_policy policy[MQTT_CLASSES];
+	/* QoS 1 and 2 messages in flight, 0: unlimited */
+	unsigned int inflight;
+	/* drop QoS 0 messages beyond that many unsent ones, 0: never */
+	unsigned int queued;
+};
+
+int mqtt_init(struct mosquitto **handle, struct fhz_port *fhz_ports,
+	      unsigned int fhz_count, const char *host, int port,
+	      const char *username, const char *password,
+	      const struct mqtt_options *mqtt_options);
 
 void mqtt_close(struct mosquitto *mosquitto);
-int mqtt_handle(struct mosquitto *mosquitto);
+void mqtt_poll(struct mosquitto *mosquitto, struct pollfd *pollfd);
+int mqtt_timeout(struct mosquitto *mosquitto);
+int mqtt_handle(struct mosquitto *mosquitto, short revents);
 int mqtt_publish(struct mosquitto *mosquitto,
 		 const struct fhz_message *message);
+bool mqtt_state_pending(void);
+bool mqtt_connected(void);
+unsigned int mqtt_outstanding(void);
+void mqtt_state_restore(void);
+int mqtt_policy_parse(struct mqtt_options *mqtt_options, const char *arg);
@@ -0,0 +1,66 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* decoded messages in flight to the publisher, must be a power of two */
+#define PIPELINE_RING_SIZE 1024
+
+/*
+ * Single producer, single consumer ring. Only the serial thread moves the
+ * head, only the publisher moves the tail, both are free running.
+ */
+struct pipeline {
+	struct fhz_message ring[PIPELINE_RING_SIZE];
+	atomic_uint head;
+	atomic_uint tail;
+	/* messages dropped because the publisher fell behind */
+	atomic_ulong overflows;
+};
+
+static inline bool pipeline_push(struct pipeline *pipeline,
+				 const struct fhz_message *message)
+{
+	unsigned int head = atomic_load_explicit(&pipeline->head,
+						 memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&pipeline->tail,
+						 memory_order_acquire);
+
+	if (head - tail == PIPELINE_RING_SIZE) {
+		atomic_fetch_add_explicit(&pipeline->overflows, 1,
+					  memory_order_relaxed);
+		return false;
+	}
+
+	pipeline->ring[head & (PIPELINE_RING_SIZE - 1)] = *message;
+	atomic_store_explicit(&pipeline->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+static inline bool pipeline_pop(struct pipeline *pipeline,
+				struct fhz_message *message)
+{
+	unsigned int tail = atomic_load_explicit(&pipeline->tail,
+						 memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&pipeline->head,
+						 memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	*message = pipeline->ring[tail & (PIPELINE_RING_SIZE - 1)];
+	atomic_store_explicit(&pipeline->tail, tail + 1, memory_order_release);
+
+	return true;
+}
@@ -0,0 +1,203 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fhz.h"
+#include "snapshot.h"
+
+struct snapshot_entry {
+	struct hauscode hauscode;
+	unsigned char port;
+	uint32_t valid;
+	int64_t last_seen;
+	unsigned char value[FHT_FIELDS];
+};
+
+struct snapshot_slot {
+	struct snapshot_header header;
+	struct snapshot_entry entries[SNAPSHOT_ENTRIES];
+};
+
+static struct snapshot_slot *slots;
+/* of the latest valid slot, 0 if there is none */
+static uint64_t generation;
+
+static uint32_t snapshot_checksum(const struct snapshot_slot *slot)
+{
+	const unsigned char *c;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	c = (const unsigned char *)&slot->header.generation;
+	for (i = 0; i < sizeof(slot->header.generation); i++)
+		hash = (hash ^ c[i]) * 16777619;
+
+	c = (const unsigned char *)&slot->header.count;
+	for (i = 0; i < sizeof(slot->header.count); i++)
+		hash = (hash ^ c[i]) * 16777619;
+
+	c = (const unsigned char *)slot->entries;
+	for (i = 0; i < slot->header.count * sizeof(*slot->entries); i++)
+		hash = (hash ^ c[i]) * 16777619;
+
+	return hash;
+}
+
+static bool snapshot_slot_valid(const struct snapshot_slot *slot)
+{
+	const struct snapshot_header *header = &slot->header;
+
+	return !memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) &&
+	       header->version == SNAPSHOT_VERSION &&
+	       header->entry_size == sizeof(struct snapshot_entry) &&
+	       header->fields == FHT_FIELDS &&
+	       header->count <= SNAPSHOT_ENTRIES &&
+	       header->checksum == snapshot_checksum(slot);
+}
+
+/* restored devices are stale until the FHT reports again */
+static void snapshot_restore(const char *path)
+{
+	const struct snapshot_slot *slot = NULL;
+	const struct snapshot_entry *entry;
+	struct fht_device *device;
+	unsigned int i;
+
+	for (i = 0; i < 2; i++)
+		if (snapshot_slot_valid(&slots[i]) &&
+		    (!slot || slots[i].header.generation >
+			      slot->header.generation))
+			slot = &slots[i];
+	if (!slot)
+		return;
+
+	generation = slot->header.generation;
+	for (i = 0; i < slot->header.count; i++) {
+		entry = &slot->entries[i];
+		device = fht_device(&entry->hauscode);
+		if (!device)
+			continue;
+
+		device->last_seen = entry->last_seen;
+		device->port = entry->port;
+		device->valid = entry->valid;
+		memcpy(device->value, entry->value, sizeof(device->value));
+		device->stale = device->valid;
+	}
+
+	printf("Snapshot %s: restored %u FHTs\n", path, slot->header.count);
+}
+
+int snapshot_open(const char *path)
+{
+	size_t size = 2 * sizeof(*slots);
+	int fd, err;
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		error("opening %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	/* sparse, only the entries of FHTs seen take up space */
+	if (ftruncate(fd, size)) {
+		err = -errno;
+		error("resizing %s: %s\n", path, strerror(errno));
+		goto close_out;
+	}
+
+	slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (slots == MAP_FAILED) {
+		err = -errno;
+		error("mapping %s: %s\n", path, strerror(errno));
+		slots = NULL;
+		goto close_out;
+	}
+
+	snapshot_restore(path);
+	err = 0;
+
+close_out:
+	close(fd);
+	return err;
+}
+
+void snapshot_close(void)
+{
+	if (!slots)
+		return;
+
+	snapshot_write();
+	msync(slots, 2 * sizeof(*slots), MS_SYNC);
+	munmap(slots, 2 * sizeof(*slots));
+	slots = NULL;
+}
+
+bool snapshot_enabled(void)
+{
+	return slots;
+}
+
+/* called by the thread that decodes, so devices don't change underneath */
+int snapshot_write(void)
+{
+	struct snapshot_slot *slot;
+	struct snapshot_entry *entry;
+	const struct fht_device *device;
+	struct hauscode hauscode;
+	unsigned int count = 0;
+
+	if (!slots)
+		return -ENODEV;
+
+	slot = &slots[(generation + 1) % 2];
+	for (hauscode.upper = 0; hauscode.upper < FHT_HAUSCODE_MAX;
+	     hauscode.upper++)
+		for (hauscode.lower = 0; hauscode.lower < FHT_HAUSCODE_MAX;
+		     hauscode.lower++) {
+			device = fht_device(&hauscode);
+			if (!device->last_seen)
+				continue;
+
+			entry = &slot->entries[count++];
+			memset(entry, 0, sizeof(*entry));
+			entry->hauscode = hauscode;
+			entry->port = device->port;
+			entry->valid = device->valid;
+			entry->last_seen = device->last_seen;
+			memcpy(entry->value, device->value,
+			       sizeof(entry->value));
+		}
+
+	memcpy(slot->header.magic, SNAPSHOT_MAGIC, sizeof(slot->header.magic));
+	slot->header.version = SNAPSHOT_VERSION;
+	slot->header.entry_size = sizeof(*entry);
+	slot->header.fields = FHT_FIELDS;
+	slot->header.count = count;
+	slot->header.generation = ++generation;
+	/* the entries must be complete before the checksum covers them */
+	atomic_signal_fence(memory_order_release);
+	slot->header.checksum = snapshot_checksum(slot);
+
+	/* a crash of the process is covered by the page cache already */
+	msync(slots, 2 * sizeof(*slots), MS_ASYNC);
+
+	return 0;
+}
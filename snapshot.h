@@ -0,0 +1,41 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The state of all FHTs seen, checkpointed to a file that is mapped to
+ * memory. The file holds two slots of a header, followed by up to
+ * SNAPSHOT_ENTRIES entries. A checkpoint overwrites the older slot, so a
+ * crash in the middle of it leaves the previous one intact. The checksum
+ * covers the generation, the count and the entries.
+ */
+#define SNAPSHOT_MAGIC "FHZSNP1\n"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ENTRIES (FHT_HAUSCODE_MAX * FHT_HAUSCODE_MAX)
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	/* the fields of a device, as of enum fht_field */
+	uint32_t fields;
+	uint32_t count;
+	uint64_t generation;
+	uint32_t checksum;
+};
+
+int snapshot_open(const char *path);
+void snapshot_close(void);
+bool snapshot_enabled(void);
+int snapshot_write(void);
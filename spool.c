@@ -0,0 +1,192 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fhz.h"
+#include "metrics.h"
+#include "spool.h"
+
+struct spool_record {
+	/* the head when the record was written */
+	uint64_t position;
+	uint32_t checksum;
+	struct spool_message message;
+};
+
+static struct spool_header *spool;
+static struct spool_record *records;
+static size_t spool_size;
+
+static uint32_t spool_checksum(const struct spool_message *message)
+{
+	const unsigned char *c = (const unsigned char *)message;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < sizeof(*message); i++)
+		hash = (hash ^ c[i]) * 16777619;
+
+	return hash;
+}
+
+static inline struct spool_record *spool_record(uint64_t position)
+{
+	return &records[position % SPOOL_RECORDS];
+}
+
+static bool spool_record_valid(uint64_t position)
+{
+	const struct spool_record *record = spool_record(position);
+
+	return record->position == position &&
+	       record->checksum == spool_checksum(&record->message);
+}
+
+/* a spool of a different build or a foreign file starts over */
+static void spool_recover(const char *path)
+{
+	uint64_t position;
+
+	if (memcmp(spool->magic, SPOOL_MAGIC, sizeof(spool->magic)) ||
+	    spool->record_size != sizeof(struct spool_record) ||
+	    spool->records != SPOOL_RECORDS ||
+	    spool->head - spool->tail > SPOOL_RECORDS) {
+		memset(spool, 0, sizeof(*spool));
+		memcpy(spool->magic, SPOOL_MAGIC, sizeof(spool->magic));
+		spool->record_size = sizeof(struct spool_record);
+		spool->records = SPOOL_RECORDS;
+		return;
+	}
+
+	/* records the page cache didn't write back before a power loss */
+	for (position = spool->tail; position != spool->head; position++)
+		if (!spool_record_valid(position))
+			break;
+	if (position != spool->head)
+		fprintf(stderr, "Spool %s: dropping %llu torn messages\n",
+			path, (unsigned long long)(spool->head - position));
+	spool->head = position;
+
+	if (spool->head != spool->tail)
+		printf("Spool %s: %llu messages pending\n", path,
+		       (unsigned long long)(spool->head - spool->tail));
+}
+
+int spool_open(const char *path)
+{
+	int fd, err;
+
+	spool_size = sizeof(*spool) +
+		     (size_t)SPOOL_RECORDS * sizeof(struct spool_record);
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		error("opening %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	/* sparse, blocks are only allocated once records are written */
+	if (ftruncate(fd, spool_size)) {
+		err = -errno;
+		error("resizing %s: %s\n", path, strerror(errno));
+		goto close_out;
+	}
+
+	spool = mmap(NULL, spool_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		     0);
+	if (spool == MAP_FAILED) {
+		err = -errno;
+		error("mapping %s: %s\n", path, strerror(errno));
+		spool = NULL;
+		goto close_out;
+	}
+	records = (struct spool_record *)(spool + 1);
+
+	spool_recover(path);
+	err = 0;
+
+close_out:
+	close(fd);
+	return err;
+}
+
+void spool_close(void)
+{
+	if (!spool)
+		return;
+
+	msync(spool, spool_size, MS_SYNC);
+	munmap(spool, spool_size);
+	spool = NULL;
+}
+
+bool spool_enabled(void)
+{
+	return spool;
+}
+
+bool spool_empty(void)
+{
+	return !spool || spool->head == spool->tail;
+}
+
+/* if the spool is full, the oldest message is dropped */
+int spool_push(const struct spool_message *message)
+{
+	struct spool_record *record;
+
+	if (!spool)
+		return -ENODEV;
+
+	if (spool->head - spool->tail == SPOOL_RECORDS) {
+		spool->tail++;
+		metrics_inc(metrics.spool_dropped);
+	}
+
+	record = spool_record(spool->head);
+	record->message = *message;
+	record->position = spool->head;
+	record->checksum = spool_checksum(&record->message);
+
+	/* the record must be complete before the head moves over it */
+	atomic_signal_fence(memory_order_release);
+	spool->head++;
+	metrics_inc(metrics.spooled);
+
+	return 0;
+}
+
+int spool_peek(struct spool_message *message)
+{
+	if (spool_empty())
+		return -ENODATA;
+
+	*message = spool_record(spool->tail)->message;
+	return 0;
+}
+
+void spool_pop(void)
+{
+	if (spool_empty())
+		return;
+
+	spool->tail++;
+	metrics_inc(metrics.spool_flushed);
+}
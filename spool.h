@@ -0,0 +1,54 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Messages that couldn't be published while the broker was unreachable,
+ * in a ring file that is mapped to memory. A spool starts with the
+ * header, followed by SPOOL_RECORDS records. Head and tail are free
+ * running record counters. A record is written before the head moves
+ * over it, and carries its position and a checksum, so neither a crash
+ * nor a torn write on power loss brings back garbage.
+ */
+#define SPOOL_MAGIC "FHZSPL3\n"
+#define SPOOL_RECORDS 65536
+
+#define SPOOL_TOPIC_MAX 48
+/* fits the state document of a FHT */
+#define SPOOL_PAYLOAD_MAX 512
+
+struct spool_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t records;
+	uint64_t head;
+	uint64_t tail;
+};
+
+/* a message as rendered for the broker, published verbatim later on */
+struct spool_message {
+	char topic[SPOOL_TOPIC_MAX];
+	uint16_t length;
+	uint8_t qos;
+	uint8_t retain;
+	unsigned char payload[SPOOL_PAYLOAD_MAX];
+};
+
+int spool_open(const char *path);
+void spool_close(void);
+bool spool_enabled(void);
+bool spool_empty(void);
+int spool_push(const struct spool_message *message);
+int spool_peek(struct spool_message *message);
+void spool_pop(void);
@@ -0,0 +1,437 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Emulates a FHZ1000 with a set of virtual FHTs on a pseudo terminal.
+ * Set requests are acked per register, after an optional RF delay, and
+ * every FHT periodically reports its state.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "fhz.h"
+
+#define EMU_DEVICES_MAX 64
+#define EMU_ACKS_MAX 256
+
+/* registers of a FHT, see fht.c */
+#define FHT_IS_VALVE 0x00
+#define FHT_MODE 0x3e
+#define FHT_DESIRED_TEMP 0x41
+#define FHT_IS_TEMP_LOW 0x42
+#define FHT_IS_TEMP_HIGH 0x43
+#define FHT_STATUS 0x44
+
+/* the registers a FHT reports on its own */
+static const unsigned char emu_reports[] = {
+	FHT_IS_VALVE, FHT_MODE, FHT_DESIRED_TEMP, FHT_IS_TEMP_LOW,
+	FHT_IS_TEMP_HIGH, FHT_STATUS,
+};
+
+struct emu_device {
+	struct hauscode hauscode;
+	unsigned char regs[256];
+	unsigned long long next_report;
+};
+
+struct emu_ack {
+	struct hauscode hauscode;
+	unsigned char memory;
+	unsigned char value;
+	unsigned long long due;
+};
+
+static struct emu_device devices[EMU_DEVICES_MAX];
+static unsigned int device_count;
+
+/* pending acks, ordered by due time as the delay is constant */
+static struct emu_ack acks[EMU_ACKS_MAX];
+static unsigned int ack_head, ack_tail;
+
+static unsigned int report_interval = 10000;
+static unsigned int ack_delay;
+
+static int emu_send(int fd, const struct payload *payload)
+{
+	unsigned char buffer[256 + 4];
+	unsigned char bc = 0;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < payload->len; i++)
+		bc += payload->data[i];
+
+	buffer[0] = FHZ_MAGIC;
+	buffer[1] = payload->len + 2;
+	buffer[2] = payload->tt;
+	buffer[3] = bc;
+	memcpy(buffer + 4, payload->data, payload->len);
+
+	ret = write(fd, buffer, payload->len + 4);
+	if (ret != payload->len + 4) {
+		error("Error sending FHZ frame: %s\n",
+		      ret == -1 ? strerror(errno) : "short write");
+		return ret == -1 ? -errno : -EIO;
+	}
+
+	return 0;
+}
+
+static int emu_status(int fd, const struct emu_device *device,
+		      unsigned char memory)
+{
+	const struct payload payload = {
+		.tt = 0x04,
+		.len = 10,
+		.data = {0x09, 0x09, 0xa0, 0x01, device->hauscode.upper,
+			 device->hauscode.lower, memory, 0x00, 0x66,
+			 device->regs[memory]},
+	};
+
+	return emu_send(fd, &payload);
+}
+
+static int emu_ack(int fd, const struct emu_ack *ack)
+{
+	const struct payload payload = {
+		.tt = 0x04,
+		.len = 9,
+		.data = {0x83, 0x09, 0x83, 0x01, ack->hauscode.upper,
+			 ack->hauscode.lower, ack->memory, ack->value, 0x00},
+	};
+
+	return emu_send(fd, &payload);
+}
+
+static struct emu_device *emu_device(const struct hauscode *hauscode)
+{
+	unsigned int i;
+
+	for (i = 0; i < device_count; i++)
+		if (devices[i].hauscode.upper == hauscode->upper &&
+		    devices[i].hauscode.lower == hauscode->lower)
+			return &devices[i];
+
+	return NULL;
+}
+
+/*
+ * fht_send() frames: 02 01 83 | hauscode | (register value)*
+ * FHTs we don't emulate stay silent, like they would on air.
+ */
+static void emu_request(const struct payload *payload, unsigned long long now)
+{
+	struct emu_device *device;
+	struct hauscode hauscode;
+	struct emu_ack *ack;
+	int i;
+
+	if (payload->tt != 0x04 || payload->len < 7 ||
+	    payload->data[0] != 0x02 || payload->data[1] != 0x01 ||
+	    payload->data[2] != 0x83)
+		return;
+
+	hauscode.upper = payload->data[3];
+	hauscode.lower = payload->data[4];
+	device = emu_device(&hauscode);
+	if (!device)
+		return;
+
+	for (i = 5; i + 1 < payload->len; i += 2) {
+		device->regs[payload->data[i]] = payload->data[i + 1];
+		printf("%02u%02u: set %02x = %02x\n", hauscode.upper,
+		       hauscode.lower, payload->data[i], payload->data[i + 1]);
+
+		if (ack_head - ack_tail == EMU_ACKS_MAX) {
+			fprintf(stderr, "Ack queue overflow\n");
+			continue;
+		}
+
+		ack = &acks[ack_head++ % EMU_ACKS_MAX];
+		ack->hauscode = hauscode;
+		ack->memory = payload->data[i];
+		ack->value = payload->data[i + 1];
+		ack->due = now + ack_delay;
+	}
+}
+
+/* cut complete frames out of buffer, returns the number of bytes consumed */
+static unsigned int emu_parse(const unsigned char *buffer, unsigned int length,
+			      unsigned long long now)
+{
+	unsigned int consumed = 0, frame;
+	struct payload payload;
+	unsigned char bc;
+	int i;
+
+	while (consumed < length) {
+		if (buffer[consumed] != FHZ_MAGIC) {
+			consumed++;
+			continue;
+		}
+
+		if (length - consumed < 2)
+			break;
+
+		frame = buffer[consumed + 1] + 2;
+		if (frame < 4) {
+			consumed++;
+			continue;
+		}
+
+		if (length - consumed < frame)
+			break;
+
+		payload.tt = buffer[consumed + 2];
+		payload.len = frame - 4;
+		memcpy(payload.data, buffer + consumed + 4, payload.len);
+
+		bc = 0;
+		for (i = 0; i < payload.len; i++)
+			bc += payload.data[i];
+
+		if (bc != buffer[consumed + 3]) {
+			fprintf(stderr, "Frame checksum mismatch\n");
+			consumed++;
+			continue;
+		}
+
+		emu_request(&payload, now);
+		consumed += frame;
+	}
+
+	return consumed;
+}
+
+static int emu_add_device(const char *str)
+{
+	struct emu_device *device;
+	int err;
+
+	if (device_count == EMU_DEVICES_MAX)
+		return -ENOSPC;
+
+	device = &devices[device_count];
+	err = hauscode_from_string(str, &device->hauscode);
+	if (err)
+		return err;
+
+	/* a FHT in auto mode at 21.5 degrees, heading for 21 */
+	device->regs[FHT_IS_VALVE] = 0x26;
+	device->regs[FHT_MODE] = 0;
+	device->regs[FHT_DESIRED_TEMP] = 42;
+	device->regs[FHT_IS_TEMP_LOW] = 215 & 0xff;
+	device->regs[FHT_IS_TEMP_HIGH] = 215 >> 8;
+	device->regs[FHT_STATUS] = 0;
+
+	/* don't let all devices report at once */
+	device->next_report = monotonic_ms() + 100 * device_count;
+
+	device_count++;
+	return 0;
+}
+
+static int emu_open_pty(const char *link)
+{
+	struct termios tty;
+	const char *name;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd == -1) {
+		error("posix_openpt: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	if (grantpt(fd) || unlockpt(fd) || !(name = ptsname(fd))) {
+		error("Unable to set up pty: %s\n", strerror(errno));
+		goto close_out;
+	}
+
+	/* frames are binary, don't let the line discipline touch them */
+	if (tcgetattr(fd, &tty)) {
+		error("tcgetattr: %s\n", strerror(errno));
+		goto close_out;
+	}
+	cfmakeraw(&tty);
+	if (tcsetattr(fd, TCSANOW, &tty)) {
+		error("tcsetattr: %s\n", strerror(errno));
+		goto close_out;
+	}
+
+	if (link) {
+		unlink(link);
+		if (symlink(name, link)) {
+			error("symlink %s: %s\n", link, strerror(errno));
+			goto close_out;
+		}
+		name = link;
+	}
+
+	printf("Emulating FHZ1000 on %s\n", name);
+	fflush(stdout);
+
+	return fd;
+
+close_out:
+	close(fd);
+	return -errno;
+}
+
+static void __attribute__((noreturn)) usage(int code)
+{
+	printf("Usage: fhz_emulator [-i seconds] [-d ms] [-l link] "
+	       "hauscode...\n"
+	       "\n"
+	       "  -i seconds  status report interval of each FHT (default: 10)\n"
+	       "  -d ms       RF delay before a set request is acked "
+	       "(default: 0)\n"
+	       "  -l link     symlink the pty to link\n");
+	exit(code);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char buffer[1024];
+	unsigned int length = 0, consumed, i, j;
+	unsigned long long now, next;
+	const char *link = NULL;
+	struct emu_device *device;
+	struct pollfd pfd;
+	int err, fd, opt, slave;
+	ssize_t ret;
+
+	while ((opt = getopt(argc, argv, "d:hi:l:")) != -1) {
+		switch (opt) {
+		case 'd':
+			ack_delay = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			report_interval = strtoul(optarg, NULL, 10) * 1000;
+			break;
+		case 'l':
+			link = optarg;
+			break;
+		case 'h':
+			usage(0);
+		default:
+			usage(-EINVAL);
+		}
+	}
+
+	if (optind == argc || !report_interval)
+		usage(-EINVAL);
+
+	for (i = optind; i < argc; i++) {
+		err = emu_add_device(argv[i]);
+		if (err) {
+			error("Invalid hauscode %s: %s\n", argv[i],
+			      strerror(-err));
+			return err;
+		}
+	}
+
+	fd = emu_open_pty(link);
+	if (fd < 0)
+		return fd;
+
+	/* hold the slave open, so the master survives clients reconnecting */
+	slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	if (slave == -1) {
+		err = -errno;
+		error("Opening %s: %s\n", ptsname(fd), strerror(errno));
+		goto close_out;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	do {
+		now = monotonic_ms();
+
+		while (ack_tail != ack_head &&
+		       acks[ack_tail % EMU_ACKS_MAX].due <= now) {
+			err = emu_ack(fd, &acks[ack_tail++ % EMU_ACKS_MAX]);
+			if (err)
+				goto close_out;
+		}
+
+		next = now + report_interval;
+		for (i = 0; i < device_count; i++) {
+			device = &devices[i];
+			if (device->next_report <= now) {
+				for (j = 0; j < ARRAY_SIZE(emu_reports); j++) {
+					err = emu_status(fd, device,
+							 emu_reports[j]);
+					if (err)
+						goto close_out;
+				}
+				device->next_report += report_interval;
+			}
+			if (device->next_report < next)
+				next = device->next_report;
+		}
+		if (ack_tail != ack_head &&
+		    acks[ack_tail % EMU_ACKS_MAX].due < next)
+			next = acks[ack_tail % EMU_ACKS_MAX].due;
+
+		err = poll(&pfd, 1, next > now ? next - now : 0);
+		if (err == -1) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			error("poll: %s\n", strerror(errno));
+			break;
+		}
+
+		if (!(pfd.revents & POLLIN))
+			continue;
+
+		ret = read(fd, buffer + length, sizeof(buffer) - length);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			err = -errno;
+			error("read: %s\n", strerror(errno));
+			break;
+		}
+		length += ret;
+
+		consumed = emu_parse(buffer, length, monotonic_ms());
+		/* a full buffer without a frame is garbage */
+		if (!consumed && length == sizeof(buffer))
+			consumed = length;
+		memmove(buffer, buffer + consumed, length - consumed);
+		length -= consumed;
+		fflush(stdout);
+	} while (true);
+
+close_out:
+	if (slave != -1)
+		close(slave);
+	close(fd);
+	if (link)
+		unlink(link);
+	return err;
+}
@@ -0,0 +1,101 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "fhz.h"
+#include "trace.h"
+
+struct trace_histogram trace_histograms[TRACE_STAGES];
+
+static const char *const trace_names[] = {
+	[TRACE_RX_FRAME] = "rx-frame",
+	[TRACE_RX_DECODE] = "rx-decode",
+	[TRACE_RX_PUBLISH] = "rx-publish",
+	[TRACE_RX_TOTAL] = "rx-total",
+	[TRACE_TX] = "tx",
+};
+
+#define load(value) atomic_load_explicit(&(value), memory_order_relaxed)
+#define store(value, x) \
+	atomic_store_explicit(&(value), (x), memory_order_relaxed)
+
+static unsigned int trace_bucket(unsigned long long ns)
+{
+	unsigned int exponent;
+
+	if (ns < TRACE_SUB_BUCKETS)
+		return ns;
+
+	exponent = 63 - __builtin_clzll(ns);
+	if (exponent > TRACE_MAX_BITS)
+		return TRACE_BUCKETS - 1;
+
+	return (exponent - TRACE_SUB_BITS + 1) * TRACE_SUB_BUCKETS +
+	       ((ns >> (exponent - TRACE_SUB_BITS)) & (TRACE_SUB_BUCKETS - 1));
+}
+
+/* upper bound of a bucket */
+static unsigned long long trace_value(unsigned int bucket)
+{
+	unsigned int exponent, sub;
+
+	if (bucket < TRACE_SUB_BUCKETS)
+		return bucket;
+
+	exponent = bucket / TRACE_SUB_BUCKETS + TRACE_SUB_BITS - 1;
+	sub = bucket % TRACE_SUB_BUCKETS;
+
+	return ((unsigned long long)(TRACE_SUB_BUCKETS + sub + 1) <<
+		(exponent - TRACE_SUB_BITS)) - 1;
+}
+
+void trace_record(enum trace_stage stage, unsigned long long ns)
+{
+	struct trace_histogram *histogram = &trace_histograms[stage];
+	unsigned int bucket = trace_bucket(ns);
+
+	store(histogram->buckets[bucket], load(histogram->buckets[bucket]) + 1);
+	store(histogram->count, load(histogram->count) + 1);
+	if (ns > load(histogram->max))
+		store(histogram->max, ns);
+}
+
+void trace_dump(FILE *file)
+{
+	static const double percentiles[] = {50, 90, 99, 99.9};
+	struct trace_histogram *histogram;
+	unsigned long long value, max;
+	unsigned long count, seen, rank;
+	unsigned int stage, bucket, i;
+
+	fprintf(file, "%-12s %10s %10s %10s %10s %10s %10s\n", "stage",
+		"count", "p50/us", "p90/us", "p99/us", "p99.9/us", "max/us");
+
+	for (stage = 0; stage < TRACE_STAGES; stage++) {
+		histogram = &trace_histograms[stage];
+		count = load(histogram->count);
+		max = load(histogram->max);
+
+		fprintf(file, "%-12s %10lu", trace_names[stage], count);
+		for (i = 0, bucket = 0, seen = 0; i < ARRAY_SIZE(percentiles);
+		     i++) {
+			rank = count * percentiles[i] / 100;
+			while (bucket < TRACE_BUCKETS &&
+			       seen + load(histogram->buckets[bucket]) <= rank)
+				seen += load(histogram->buckets[bucket++]);
+			/* the bucket bound may exceed what was recorded */
+			value = count ? trace_value(bucket) : 0;
+			fprintf(file, " %10.1f", (value < max ? value : max) / 1e3);
+		}
+		fprintf(file, " %10.1f\n", max / 1e3);
+	}
+	fflush(file);
+}
@@ -0,0 +1,52 @@
+/*
+ * fhz2mqtt, a FHZ to MQTT bridge
+ *
+ * Copyright (c) Ralf Ramsauer, 2018
+ *
+ * Authors:
+ *  Ralf Ramsauer <ralf@ramses-pyramidenbau.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+/*
+ * Log-linear histograms of latencies in ns, like HDR histograms: every
+ * power of two is split into 2^TRACE_SUB_BITS buckets, which bounds the
+ * relative error to 1/2^TRACE_SUB_BITS.
+ */
+#define TRACE_SUB_BITS 3
+#define TRACE_SUB_BUCKETS (1 << TRACE_SUB_BITS)
+/* up to 2^40 ns, about 18 minutes */
+#define TRACE_MAX_BITS 40
+#define TRACE_BUCKETS ((TRACE_MAX_BITS - TRACE_SUB_BITS + 2) * \
+		       TRACE_SUB_BUCKETS)
+
+enum trace_stage {
+	/* serial port readable -> frame cut from the receive buffer */
+	TRACE_RX_FRAME,
+	/* frame -> decoded */
+	TRACE_RX_DECODE,
+	/* decoded -> handed to mosquitto_publish() */
+	TRACE_RX_PUBLISH,
+	/* serial port readable -> handed to mosquitto_publish() */
+	TRACE_RX_TOTAL,
+	/* set request from the broker -> write() to the FHZ */
+	TRACE_TX,
+	TRACE_STAGES,
+};
+
+/* each histogram has a single writer */
+struct trace_histogram {
+	atomic_ulong buckets[TRACE_BUCKETS];
+	atomic_ulong count;
+	atomic_ullong max;
+};
+
+extern struct trace_histogram trace_histograms[TRACE_STAGES];
+
+void trace_record(enum trace_stage stage, unsigned long long ns);
+void trace_dump(FILE *file);